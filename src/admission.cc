@@ -0,0 +1,127 @@
+#include "admission.hh"
+#include "metrics.hh"
+
+#include <cmath>
+#include <list>
+
+namespace rainboa::admission {
+	
+	typedef std::chrono::steady_clock clock;
+	
+	static constexpr size_t num_shards = 16;
+	
+	static std::mutex m;
+	static std::condition_variable cv;
+	static size_t limit, in_flight = 0;
+	static size_t queue_max, queued = 0;
+	static clock::duration queue_delay;
+	
+	static double rate, burst; // tokens per second, bucket size, rate 0 disables
+	
+	struct bucket {
+		double tokens;
+		clock::time_point last;
+		std::list<std::string>::iterator lru_i;
+	};
+	struct shard {
+		std::mutex m;
+		std::unordered_map<std::string, bucket> buckets;
+		std::list<std::string> lru; // most recently seen at the front
+	};
+	static shard shards[num_shards];
+	static size_t shard_capacity;
+	
+	static metrics::metric_id rejected_busy, rejected_rate, queued_metric;
+	
+	void init(size_t concurrency, size_t threads) {
+		limit = std::max<long long>(util::setting_int("ADMIT_CONCURRENCY", concurrency), 1);
+		if (limit >= threads) scilogw << asterid::strf("admission limit %zu is not below the %zu server threads, requests will never be queued or shed", limit, threads);
+		queue_max = util::setting_int("ADMIT_QUEUE", limit * 4);
+		queue_delay = std::chrono::milliseconds {util::setting_int("ADMIT_QUEUE_MS", 100)};
+		rate = util::setting_int("CLIENT_RATE", 0);
+		burst = std::max<double>(util::setting_int("CLIENT_BURST", rate * 2), 1);
+		shard_capacity = std::max<long long>(util::setting_int("CLIENT_BUCKETS", 65536) / num_shards, 1);
+		rejected_busy = metrics::counter("rainboa_admission_rejected_total", "reason=\"busy\"", "requests turned away before processing");
+		rejected_rate = metrics::counter("rainboa_admission_rejected_total", "reason=\"rate\"", "requests turned away before processing");
+		queued_metric = metrics::histogram("rainboa_admission_wait_seconds", "", "time admitted requests spent queued");
+	}
+	
+	size_t concurrency() {
+		return limit;
+	}
+	
+	// refills lazily on access, the number of buckets is capped and the least recently seen client is forgotten first
+	static bool take_token(std::string_view client, unsigned & retry_after) {
+		shard & sh = shards[std::hash<std::string_view>{}(client) % num_shards];
+		clock::time_point now = clock::now();
+		std::lock_guard<std::mutex> lk {sh.m};
+		auto [i, fresh] = sh.buckets.try_emplace(std::string {client}, bucket {burst, now, {}});
+		bucket & b = i->second;
+		if (fresh) {
+			sh.lru.push_front(i->first);
+			b.lru_i = sh.lru.begin();
+			if (sh.buckets.size() > shard_capacity) {
+				sh.buckets.erase(sh.lru.back());
+				sh.lru.pop_back();
+			}
+		} else {
+			sh.lru.splice(sh.lru.begin(), sh.lru, b.lru_i);
+			b.tokens = std::min(burst, b.tokens + std::chrono::duration<double>(now - b.last).count() * rate);
+			b.last = now;
+		}
+		if (b.tokens >= 1) {
+			b.tokens -= 1;
+			return true;
+		}
+		retry_after = std::ceil((1 - b.tokens) / rate);
+		return false;
+	}
+	
+	ticket admit(std::string_view client) {
+		ticket t;
+		if (rate > 0 && !client.empty() && !take_token(client, t.retry_after)) {
+			metrics::inc(rejected_rate);
+			return t;
+		}
+		
+		std::unique_lock<std::mutex> lk {m};
+		if (in_flight < limit && queued == 0) {
+			in_flight++;
+			t.admitted = true;
+			return t;
+		}
+		if (queued >= queue_max) {
+			lk.unlock();
+			metrics::inc(rejected_busy);
+			t.retry_after = 1;
+			return t;
+		}
+		
+		// new arrivals don't jump ahead of anyone already queued, see the fast path above
+		auto start = clock::now();
+		queued++;
+		bool ok = cv.wait_until(lk, start + queue_delay, [](){ return in_flight < limit; });
+		queued--;
+		if (ok) {
+			in_flight++;
+			t.admitted = true;
+		}
+		lk.unlock();
+		
+		if (ok) metrics::observe(queued_metric, clock::now() - start);
+		else {
+			metrics::inc(rejected_busy);
+			t.retry_after = 1;
+		}
+		return t;
+	}
+	
+	ticket::~ticket() {
+		if (!admitted) return;
+		{
+			std::lock_guard<std::mutex> lk {m};
+			in_flight--;
+		}
+		cv.notify_all();
+	}
+}
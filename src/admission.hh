@@ -0,0 +1,27 @@
+#pragma once
+#include "util.hh"
+
+// admission control in front of api::process: a concurrency limit with a short bounded queue behind it, and a per-client token bucket
+// anything over budget is turned away straight away instead of piling up on the database pool
+namespace rainboa::admission {
+	
+	// threads: how many threads can call admit() at once, the limit has to be below it to ever engage
+	void init(size_t concurrency, size_t threads);
+	size_t concurrency(); // the limit in effect, after RAINBOA_ADMIT_CONCURRENCY
+	
+	struct ticket {
+		ticket() = default;
+		ticket(ticket const &) = delete;
+		ticket(ticket && other) : admitted(other.admitted), retry_after(other.retry_after) { other.admitted = false; }
+		~ticket();
+		ticket & operator = (ticket const &) = delete;
+		
+		inline explicit operator bool() const { return admitted; }
+		bool admitted = false;
+		unsigned retry_after = 0; // seconds, when not admitted
+	};
+	
+	// client is whatever identifies the caller for rate limiting, empty skips the per-client bucket
+	// blocks for at most the configured queueing delay
+	ticket admit(std::string_view client);
+}
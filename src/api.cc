@@ -1,29 +1,209 @@
 #include "api_internal.hh"
+#include "kdf.hh"
+#include "metrics.hh"
 #include "psql.hh"
 
 static std::unique_ptr<postgres::pool> pgpool;
+static std::vector<std::unique_ptr<postgres::pool>> replica_pools;
+static std::atomic<size_t> replica_next {0};
 
 #define debugmsg(msg) if (pers.debug_mode) ret["debug"] = msg
-#define sqlerror do {aeon::object ret = begin_api_return(code::database_error); debugmsg(res.get_error()); scilogvs << res.get_error(); return ret;} while (0)
+#define sqlerror do {aeon::object ret = begin_api_return(res.get_sqlstate() == "57014" ? code::deadline_exceeded : code::database_error); debugmsg(res.get_error()); scilogvs << res.get_error(); return ret;} while (0)
 
 namespace rainboa::api {
 	
+	static aeon::object debug(aeon::object const &, cmd_persist & pers);
+	
+	// ================================
+	// COMMAND TABLE
+	// ================================
+	
+	struct cmd_entry {
+		std::string name;
+		api_f func = nullptr;
+		api_queue_f queue = nullptr;
+		bool reads_session = true;
+		bool barrier = false;
+		metrics::metric_id metric = 0;
+	};
+	
+	static std::vector<cmd_entry> cmds_by_id; // indexed by cmd_id, entries with no name are unused
+	static std::vector<cmd_entry const *> cmds_by_hash; // perfect hash of the names, power of two size
+	static uint64_t cmd_hash_seed = 0;
+	static bool cmds_frozen = false;
+	
+	static size_t pool_capacity;
+	static std::chrono::milliseconds pool_timeout;
+	static std::chrono::milliseconds request_timeout, request_timeout_max;
+	static size_t batch_fanout; // connections a single batch may spread over
+	static size_t batch_lane_cmds; // commands queued on a connection before spilling onto the next
+	
+	static inline uint64_t cmd_hash(std::string_view name, uint64_t seed) { // FNV-1a
+		uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+		for (char c : name) h = (h ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+		return h ^ (h >> 29);
+	}
+	
+	static void register_cmd_entry(cmd_id id, cmd_entry && entry) {
+		if (cmds_frozen) {
+			scilogve << "command registered after init: " << entry.name;
+			throwe(startup);
+		}
+		size_t idx = static_cast<size_t>(id);
+		if (cmds_by_id.size() <= idx) cmds_by_id.resize(idx + 1);
+		entry.metric = metrics::histogram("rainboa_cmd_seconds", "cmd=\"" + entry.name + "\"", "command latency, pipelined commands include their wait for the batch's pipeline");
+		cmds_by_id[idx] = std::move(entry);
+	}
+	
+	void register_cmd(cmd_id id, std::string const & cmd, api_f func) {
+		register_cmd_entry(id, {cmd, func, nullptr, true, true});
+	}
+	
+	void register_cmd_pipelined(cmd_id id, std::string const & cmd, api_queue_f queue, bool reads_session, bool barrier) {
+		register_cmd_entry(id, {cmd, nullptr, queue, reads_session, barrier});
+	}
+	
+	// searches for a seed that puts every name in its own slot, the table is tiny so this is instant
+	static void freeze_cmds() {
+		size_t n = 0;
+		for (cmd_entry const & e : cmds_by_id) if (!e.name.empty()) n++;
+		size_t size = 1;
+		while (size < n * 2) size <<= 1;
+		for (uint64_t seed = 0;; seed++) {
+			if (seed == 100000) { size <<= 1; seed = 0; }
+			std::vector<cmd_entry const *> table (size, nullptr);
+			bool collision = false;
+			for (cmd_entry const & e : cmds_by_id) {
+				if (e.name.empty()) continue;
+				cmd_entry const * & slot = table[cmd_hash(e.name, seed) & (size - 1)];
+				if (slot) { collision = true; break; }
+				slot = &e;
+			}
+			if (collision) continue;
+			cmds_by_hash = std::move(table);
+			cmd_hash_seed = seed;
+			break;
+		}
+		cmds_frozen = true;
+	}
+	
+	static inline cmd_entry const * find_cmd(aeon::object const & cmd) {
+		if (cmd.is_int()) {
+			aeon::int_t id = cmd.integer();
+			if (id < 0 || static_cast<size_t>(id) >= cmds_by_id.size() || cmds_by_id[id].name.empty()) return nullptr;
+			return &cmds_by_id[id];
+		}
+		if (!cmd.is_string()) return nullptr;
+		std::string_view name = cmd.string();
+		cmd_entry const * e = cmds_by_hash[cmd_hash(name, cmd_hash_seed) & (cmds_by_hash.size() - 1)];
+		return e && e->name == name ? e : nullptr;
+	}
+	
+	// ================================
+	// INIT
+	// ================================
+	
 	void init() {
-		pgpool.reset(new postgres::pool {"rainboa", NUM_CON});
+		kdf::init();
+		session::init();
+		register_cmd(cmd_id::debug, "debug", debug);
+		postgres::pool::config cfg;
+		cfg.min_cons = util::setting_int("POOL_MIN", util::worker_threads());
+		cfg.max_cons = util::setting_int("POOL_MAX", util::worker_threads() * 2);
+		cfg.acquire_timeout = std::chrono::milliseconds {util::setting_int("POOL_TIMEOUT_MS", 5000)};
+		cfg.connect_timeout = std::chrono::seconds {std::max<long long>(util::setting_int("DB_CONNECT_TIMEOUT_S", 5), 2)}; // libpq treats 1 as 2
+		std::string conninfo = util::setting("DB", "rainboa");
+		pgpool.reset(new postgres::pool {conninfo, cfg});
+		pool_capacity = cfg.max_cons;
+		pool_timeout = cfg.acquire_timeout;
 		if (!pgpool->ok()) {
 			scilogve << "failed to create database connection pool";
 			throwe(startup);
 		}
 		auto dbv = pgpool->acquire();
+		if (!dbv.ok()) {
+			scilogve << "failed to acquire database connection";
+			throwe(startup);
+		}
+		
+		// separated by semicolons, an unreachable replica is left out rather than holding up startup
+		std::string replicas = util::setting("DB_REPLICA");
+		for (size_t start = 0; start < replicas.size();) {
+			size_t end = std::min(replicas.find(';', start), replicas.size());
+			std::string conninfo = replicas.substr(start, end - start);
+			start = end + 1;
+			if (conninfo.empty()) continue;
+			std::unique_ptr<postgres::pool> p {new postgres::pool {conninfo, cfg}};
+			if (p->ok()) replica_pools.push_back(std::move(p));
+			else scilogvw << "skipping unreachable read replica";
+		}
+		if (!replica_pools.empty()) scilogi << asterid::strf("routing read-only statements to %zu replica(s)", replica_pools.size());
 		
 		auth_init(dbv);
+		freeze_cmds();
+		token_cache::init(*pgpool, postgres::with_connect_timeout(conninfo, cfg.connect_timeout));
+		
+		request_timeout = std::chrono::milliseconds {util::setting_int("REQUEST_TIMEOUT_MS", 10000)};
+		request_timeout_max = std::chrono::milliseconds {util::setting_int("REQUEST_TIMEOUT_MAX_MS", 60000)};
+		
+		batch_fanout = std::max<long long>(util::setting_int("BATCH_FANOUT", 4), 1);
+		batch_lane_cmds = std::max<long long>(util::setting_int("BATCH_LANE_CMDS", 8), 1);
+		
+		metrics::add_collector([](std::string & out){
+			postgres::pool::stats st = pgpool->get_stats();
+			out += asterid::strf("# HELP rainboa_pool_connections pooled database connections\n# TYPE rainboa_pool_connections gauge\n");
+			out += asterid::strf("rainboa_pool_connections{state=\"open\"} %u\nrainboa_pool_connections{state=\"in_use\"} %u\nrainboa_pool_connections{state=\"broken\"} %u\n", st.size, st.in_use, st.broken);
+			out += asterid::strf("# HELP rainboa_pool_waiters requests queued for a connection\n# TYPE rainboa_pool_waiters gauge\nrainboa_pool_waiters %u\n", st.waiters);
+			out += asterid::strf("# HELP rainboa_pool_timeouts_total acquisitions that hit their deadline\n# TYPE rainboa_pool_timeouts_total counter\nrainboa_pool_timeouts_total %llu\n", (unsigned long long)st.timeouts);
+			out += asterid::strf("# HELP rainboa_pool_reconnects_total broken connections reestablished\n# TYPE rainboa_pool_reconnects_total counter\nrainboa_pool_reconnects_total %llu\n", (unsigned long long)st.reconnects);
+		});
 	}
 	
 	void term() {
+		token_cache::term();
+		cmds_frozen = false;
+		cmds_by_hash.clear();
+		cmds_by_id.clear();
+		if (pgpool && pgpool->ok()) {
+			postgres::pool::stats st = pgpool->get_stats();
+			scilogi << asterid::strf("pool: %llu acquisitions, %llu waited (%.3f ms avg, %.3f ms max), %llu timeouts, %llu reconnects (%llu failed), %u/%u in use",
+				(unsigned long long)st.acquisitions, (unsigned long long)st.waits, st.waits ? st.wait_ns_total / 1e6 / st.waits : 0.0, st.wait_ns_max / 1e6,
+				(unsigned long long)st.timeouts, (unsigned long long)st.reconnects, (unsigned long long)st.reconnect_failures, st.in_use, st.size);
+		}
+		replica_pools.clear();
 		pgpool.reset();
+		kdf::term();
 	}
 
-	typedef std::unordered_map<aeon::str_t, api_f> map_t;
+	postgres::pool::conview & cmd_persist::route(postgres::statement const & stmt) {
+		if (stmt.mode == postgres::access::read_write) {
+			wrote = true;
+			return dbv;
+		}
+		if (wrote || replica_pools.empty()) return dbv;
+		for (size_t i = 0; !replica.ok() && i < replica_pools.size(); i++) {
+			replica = replica_pools[replica_next++ % replica_pools.size()]->try_acquire();
+			if (replica.ok()) replica.set_deadline(deadline);
+		}
+		return replica.ok() ? replica : dbv; // no replica to spare, the primary can always serve reads
+	}
+	
+	void cmd_persist::detach() {
+		replica = {};
+		dbv = {};
+	}
+	
+	bool cmd_persist::attach() {
+		if (dbv.ok()) return true;
+		dbv = pgpool->acquire(std::min(deadline, std::chrono::steady_clock::now() + pool_timeout));
+		if (!dbv.ok()) return false;
+		dbv.set_deadline(deadline);
+		return true;
+	}
+	
+	size_t capacity() {
+		return pool_capacity;
+	}
 	
 	aeon::object begin_api_return(code c) {
 		aeon::object ret = aeon::map();
@@ -36,29 +216,131 @@ namespace rainboa::api {
 		return begin_api_return(code::success);
 	}
 	
-	static map_t function_map {
-		{"debug", debug}
-	};
-	
-	void register_cmd(std::string const & cmd, api_f func) {
-		function_map[cmd] = func;
+	deadline_t deadline_for(std::string_view requested) {
+		std::chrono::milliseconds timeout = request_timeout;
+		if (!requested.empty()) {
+			char * end;
+			std::string str {requested};
+			long long ms = strtoll(str.c_str(), &end, 10);
+			if (!*end && ms > 0) timeout = std::min(std::chrono::milliseconds {ms}, request_timeout_max);
+		}
+		return std::chrono::steady_clock::now() + timeout;
 	}
 	
 	aeon::object process(aeon::object const & rec) {
+		return process(rec, deadline_for({}));
+	}
+	
+	aeon::object process(aeon::object const & rec, deadline_t deadline) {
+		aeon::object ret = aeon::array();
+		aeon::ary_t & ret_ary = ret.array();
+		process(rec, deadline, [&](aeon::object && obj){ ret_ary.push_back(std::move(obj)); });
+		return ret;
+	}
+	
+	void process(aeon::object const & rec, deadline_t deadline, std::function<void(aeon::object &&)> const & emit) {
 		cmd_persist cmdp = {
 			false,
 			0,
-			pgpool->acquire()
+			pgpool->acquire(std::min(deadline, std::chrono::steady_clock::now() + pool_timeout)),
+			deadline
+		};
+		
+		if (!cmdp.dbv.ok()) {
+			scilogve << "timed out acquiring a database connection";
+			code c = std::chrono::steady_clock::now() >= deadline ? code::deadline_exceeded : code::database_error;
+			for (size_t i = 0; i < rec.array().size(); i++) emit(begin_api_return(c));
+			return;
+		}
+		cmdp.dbv.set_deadline(deadline);
+		
+		// results wait here only until every earlier slot is filled, then go straight out through emit
+		std::deque<aeon::object> slots;
+		std::deque<bool> done;
+		size_t next_idx = 0; // request index of slots.front()
+		auto open_slot = [&]() -> size_t {
+			slots.emplace_back();
+			done.push_back(false);
+			return next_idx + slots.size() - 1;
+		};
+		auto complete = [&](size_t idx, aeon::object && obj){
+			slots[idx - next_idx] = std::move(obj);
+			done[idx - next_idx] = true;
+			while (!done.empty() && done.front()) {
+				emit(std::move(slots.front()));
+				slots.pop_front();
+				done.pop_front();
+				next_idx++;
+			}
+		};
+		
+		struct pending_cmd {
+			size_t idx;
+			api_finish_f finish;
+			metrics::metric_id metric;
+			metrics::clock::time_point start;
+		};
+		
+		// independent pipelined commands fan out over extra connections once a wave outgrows one lane, every lane is sent
+		// before any is collected so the database works on all of them at once, finish halves still run in request order
+		struct lane {
+			lane(postgres::pool::conview && v, postgres::connection & con) : dbv(std::move(v)), pl(con) {}
+			postgres::pool::conview dbv; // empty for the first lane, which runs on the session's own connection
+			postgres::pipeline pl;
+		};
+		std::vector<std::unique_ptr<lane>> lanes; // emptied around synchronous commands, which may swap out the session's connection
+		size_t wave_size = 0;
+		auto lane_for_next = [&]() -> postgres::pipeline & {
+			if (lanes.empty()) lanes.emplace_back(new lane {{}, cmdp.dbv.con()});
+			size_t want = std::min<size_t>(wave_size++ / batch_lane_cmds, batch_fanout - 1);
+			while (lanes.size() <= want) {
+				postgres::pool::conview v = pgpool->try_acquire(); // never wait, fewer lanes beats holding up the batch
+				if (!v.ok()) break;
+				v.set_deadline(deadline);
+				postgres::connection & con = v.con();
+				lanes.emplace_back(new lane {std::move(v), con});
+			}
+			return lanes[std::min(want, lanes.size() - 1)]->pl;
+		};
+		
+		std::vector<pending_cmd> pending;
+		auto flush = [&](){
+			if (pending.empty()) return;
+			for (auto & l : lanes) {
+				l->pl.collect();
+				if (l->pl.wrote()) cmdp.wrote = true;
+			}
+			wave_size = 0;
+			for (pending_cmd & p : pending) {
+				complete(p.idx, p.finish(cmdp));
+				metrics::observe(p.metric, metrics::clock::now() - p.start);
+			}
+			pending.clear();
 		};
 		
-		aeon::object ret = aeon::array();
-		aeon::ary_t & ret_ary = ret.array();
 		for (aeon::object const & obj : rec.array()) {
-			if (!obj.is_map()) { ret_ary.push_back(aeon::null); continue; }
-			auto func_i = function_map.find(obj["cmd"].string());
-			ret_ary.push_back( func_i == function_map.end() ? begin_api_return(code::unknown_cmd) : func_i->second(obj, cmdp) );
+			size_t idx = open_slot();
+			if (!obj.is_map()) { complete(idx, aeon::object {aeon::null}); continue; }
+			cmd_entry const * cmd_p = find_cmd(obj["cmd"]);
+			if (!cmd_p) { complete(idx, begin_api_return(code::unknown_cmd)); continue; }
+			cmd_entry const & cmd = *cmd_p;
+			if (metrics::clock::now() >= deadline) { complete(idx, begin_api_return(code::deadline_exceeded)); continue; }
+			if (!cmdp.attach()) { complete(idx, begin_api_return(metrics::clock::now() >= deadline ? code::deadline_exceeded : code::database_error)); continue; }
+			if (!cmd.queue) {
+				flush();
+				lanes.clear(); // idle after the flush, extra lanes shouldn't sit on connections through a detached wait either
+				metrics::timer t {cmd.metric};
+				complete(idx, cmd.func(obj, cmdp));
+				continue;
+			}
+			if (cmd.reads_session || cmd.barrier) flush();
+			auto start = metrics::clock::now();
+			postgres::pipeline & pl = lane_for_next();
+			pending.push_back({idx, cmd.queue(obj, cmdp, pl), cmd.metric, start});
+			pl.sync_point();
+			if (cmd.barrier) flush(); // nothing after it may be sent until its write is done
 		}
-		return ret;
+		flush();
 	}
 }
 
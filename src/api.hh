@@ -9,6 +9,18 @@ namespace rainboa::api {
 	void init();
 	void term();
 	
-	asterid::aeon::object process(asterid::aeon::object const & req);
+	typedef std::chrono::steady_clock::time_point deadline_t;
+	
+	// requested is the client's timeout in milliseconds, empty for RAINBOA_REQUEST_TIMEOUT_MS, capped at RAINBOA_REQUEST_TIMEOUT_MAX_MS
+	deadline_t deadline_for(std::string_view requested);
+	
+	// emit receives each command's result in request order as soon as it and everything before it has completed
+	// the batch's results are never all held at once
+	// commands that can't finish by the deadline are cancelled and report deadline_exceeded, the rest of the batch still gets its slots
+	void process(asterid::aeon::object const & req, deadline_t deadline, std::function<void(asterid::aeon::object &&)> const & emit);
+	asterid::aeon::object process(asterid::aeon::object const & req, deadline_t deadline);
+	asterid::aeon::object process(asterid::aeon::object const & req); // default deadline
+	
+	size_t capacity(); // batches that can hold a database connection at once, valid after init()
 	
 }
@@ -1,159 +1,331 @@
 #include "api_internal.hh"
+#include "kdf.hh"
+#include "migrate.hh"
+
+#include <botan/mem_ops.h>
 
 namespace rainboa::api {
 
+	static constexpr size_t token_length = 64;
+	static constexpr std::string_view token_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+	static size_t bulk_create_max; // accounts per request, across all of its acct_create_bulk commands
+	static std::string provision_key;
+	
+	static postgres::statement const stmt_create {"acct_create", "WITH base AS (INSERT INTO account.base (seed) VALUES ($1::BIGINT) RETURNING id) INSERT INTO account.token (acct_id, hash) SELECT id, $2::TEXT FROM base RETURNING acct_id", postgres::result_format::binary};
+	static postgres::statement const stmt_create_bulk {"acct_create_bulk", R"(
+		WITH rows AS (SELECT nextval('account.base_id_seq') AS id, seed, hash FROM unnest($1::BIGINT[], $2::TEXT[]) AS t (seed, hash)),
+		base AS (INSERT INTO account.base (id, seed) SELECT id, seed FROM rows)
+		INSERT INTO account.token (acct_id, hash) SELECT id, hash FROM rows
+	)"};
+	static postgres::statement const stmt_token_lookup {"acct_token_lookup", "SELECT acct_id FROM account.token WHERE hash = $1::BPCHAR", postgres::result_format::binary, postgres::access::read_only};
+	// NOTIFY payloads: "t <token hash> <acct_id> <unix time>" for a deleted token, "s <session id> <expiry>" for a single session
+	static postgres::statement const stmt_token_revoke {"acct_token_revoke", std::string {R"(
+		WITH revoked AS (DELETE FROM account.token WHERE hash = $1::BPCHAR RETURNING hash, acct_id, FLOOR(EXTRACT(EPOCH FROM NOW()))::BIGINT AS at)
+		SELECT acct_id, at, pg_notify(')"} + token_cache::revoke_channel + R"(', 't ' || hash || ' ' || acct_id || ' ' || at) FROM revoked
+	)"};
+	static postgres::statement const stmt_session_revoke {"acct_session_revoke", std::string {"SELECT pg_notify('"} + token_cache::revoke_channel + "', $1::TEXT)"};
+	static postgres::statement const stmt_auth_insert {"acct_auth_insert", "INSERT INTO account.auth (acct_id, username, passhash, salt, kdf) VALUES ($1::BIGINT, $2::TEXT, $3::TEXT, $4::BIGINT, $5::TEXT)"};
+	static postgres::statement const stmt_auth_lookup {"acct_auth_lookup", "SELECT acct_id, passhash, salt, kdf FROM account.auth WHERE username = $1::TEXT", postgres::result_format::binary, postgres::access::read_only};
+	static postgres::statement const stmt_auth_login {"acct_auth_login", "WITH login AS (UPDATE account.auth SET last_login = NOW() WHERE acct_id = $1::BIGINT) INSERT INTO account.token (acct_id, hash) VALUES ($1::BIGINT, $2::TEXT)"};
+
 	// ================================
 	// ACCT_CREATE -- create a new account
 	// ================================
-	static aeon::object acct_create(aeon::object const &, cmd_persist & pers) {
-		postgres::result res = pers.dbv.exec_params("INSERT INTO account.base (seed) VALUES ($1::BIGINT) RETURNING id", {std::to_string(util::randomized<postgres::bigint_t>())});
-		if (!res.tuples_ok()) sqlerror;
-		pers.acct_id = res.get_value(0, 0);
-		std::string token_name = util::random_str(64, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789");
-		std::string token_hash = util::hash_blake2b(token_name).hex();
-		res = pers.dbv.exec_params("INSERT INTO account.token (acct_id, hash) VALUES ($1::BIGINT, $2::TEXT)", {std::to_string(pers.acct_id), token_hash});
-		if (!res.cmd_ok()) sqlerror;
-		aeon::object ret = begin_api_return(code::success);
-		ret["token"] = token_name;
-		return ret;
+	static api_finish_f acct_create(aeon::object const &, cmd_persist &, postgres::pipeline & pl) {
+		std::string token_name = util::random_str(token_length, token_chars);
+		std::string token_hash = util::hex(util::hash_blake2b(token_name));
+		size_t q = pl.queue(stmt_create, util::randomized<postgres::bigint_t>(), token_hash);
+		return [&pl, q, token_name](cmd_persist & pers) -> aeon::object {
+			postgres::result & res = pl.get(q);
+			if (!res.tuples_ok()) sqlerror;
+			pers.acct_id = res.get<postgres::bigint_t>(0, 0);
+			aeon::object ret = begin_api_return(code::success);
+			ret["token"] = token_name;
+			if (session::enabled()) ret["session"] = session::issue(pers.acct_id);
+			return ret;
+		};
+	}
+	
+	// ================================
+	// ACCT_CREATE_BULK -- create many anonymous accounts at once
+	// ================================
+	// an operator tool, only registered when RAINBOA_PROVISION_KEY is set and every call has to present it
+	struct create_bulk_in {
+		std::string_view key;
+		aeon::int_t count;
+		static constexpr auto fields = std::make_tuple(required("key", &create_bulk_in::key), required("count", &create_bulk_in::count));
+	};
+	
+	static api_finish_f acct_create_bulk(create_bulk_in const & in, cmd_persist & pers, postgres::pipeline & pl) {
+		if (in.key.size() != provision_key.size() || !Botan::constant_time_compare(reinterpret_cast<uint8_t const *>(in.key.data()), reinterpret_cast<uint8_t const *>(provision_key.data()), provision_key.size())) {
+			return [](cmd_persist & pers) -> aeon::object {
+				aeon::object ret = begin_api_return(code::authorization_required);
+				debugmsg("invalid provisioning key");
+				return ret;
+			};
+		}
+		aeon::int_t count = in.count;
+		if (count < 1 || pers.provisioned + count > bulk_create_max) {
+			return [](cmd_persist & pers) -> aeon::object {
+				aeon::object ret = begin_api_return(code::invalid_operation);
+				debugmsg(asterid::strf("count must be at least 1 and at most %zu accounts per request", bulk_create_max));
+				return ret;
+			};
+		}
+		pers.provisioned += count;
+		// every row goes in with one statement, so the whole batch lands or none of it does
+		std::vector<std::string> tokens = util::random_strs(count, token_length, token_chars);
+		std::vector<std::string> hashes;
+		hashes.reserve(count);
+		for (std::string const & token : tokens) hashes.push_back(util::hex(util::hash_blake2b(token)));
+		std::vector<int64_t> seeds (count);
+		util::randomize_data(seeds.data(), seeds.size() * sizeof(int64_t));
+		size_t q = pl.queue(stmt_create_bulk, seeds, hashes);
+		return [&pl, q, tokens = std::move(tokens)](cmd_persist & pers) -> aeon::object {
+			postgres::result & res = pl.get(q);
+			if (!res.cmd_ok()) sqlerror;
+			aeon::object ret = begin_api_return(code::success);
+			aeon::object ary = aeon::array();
+			aeon::ary_t & tokens_ary = ary.array();
+			tokens_ary.reserve(tokens.size());
+			for (std::string const & token : tokens) tokens_ary.emplace_back(token);
+			ret["tokens"] = std::move(ary);
+			return ret;
+		};
 	}
 	
 	// ================================
 	// ACCT_TOKEN -- redeem a user id from a token
 	// ================================
-	static aeon::object acct_token(aeon::object const & in, cmd_persist & pers) {
-		std::string token_name = in["token"];
-		std::string token_hash = util::hash_blake2b(token_name).hex();
-		postgres::result res = pers.dbv.exec_params("UPDATE account.token SET last_use = NOW() WHERE hash = $1::TEXT RETURNING acct_id", {token_hash});
-		if (!res.tuples_ok()) sqlerror;
-		if (res.num_rows() != 1) {
-			aeon::object ret = begin_api_return(code::invalid_operation);
-			debugmsg("token not found");
+	struct token_in {
+		std::string_view token;
+		static constexpr auto fields = std::make_tuple(required("token", &token_in::token));
+	};
+	
+	static api_finish_f acct_token(token_in const & in, cmd_persist &, postgres::pipeline & pl) {
+		postgres::bigint_t acct_id = 0;
+		if (session::is_session(in.token)) {
+			session::status st = session::verify(in.token, acct_id);
+			return [st, acct_id](cmd_persist & pers) -> aeon::object {
+				if (st != session::status::ok) {
+					aeon::object ret = begin_api_return(st == session::status::expired ? code::session_expired : code::invalid_operation);
+					debugmsg(st == session::status::expired ? "session expired" : st == session::status::revoked ? "session revoked" : "invalid session");
+					return ret;
+				}
+				pers.acct_id = acct_id;
+				aeon::object ret = begin_api_return(code::success);
+				ret["acct_id"] = pers.acct_id;
+				return ret;
+			};
+		}
+		std::string token_hash = util::hex(util::hash_blake2b(in.token));
+		if (token_cache::lookup(token_hash, acct_id)) {
+			return [acct_id](cmd_persist & pers) -> aeon::object {
+				pers.acct_id = acct_id;
+				aeon::object ret = begin_api_return(code::success);
+				ret["acct_id"] = pers.acct_id;
+				return ret;
+			};
+		}
+		size_t q = pl.queue(stmt_token_lookup, token_hash);
+		return [&pl, q, token_hash](cmd_persist & pers) -> aeon::object {
+			postgres::result & res = pl.get(q);
+			if (!res.tuples_ok()) sqlerror;
+			if (res.num_rows() != 1) {
+				aeon::object ret = begin_api_return(code::invalid_operation);
+				debugmsg("token not found");
+				return ret;
+			}
+			pers.acct_id = res.get<postgres::bigint_t>(0, 0);
+			token_cache::insert(token_hash, pers.acct_id);
+			aeon::object ret = begin_api_return(code::success);
+			ret["acct_id"] = pers.acct_id;
 			return ret;
+		};
+	}
+	
+	// ================================
+	// ACCT_REVOKE -- invalidate a token
+	// ================================
+	// revoking a token also ends every session of its account issued up to then, a session token only ends itself
+	static api_finish_f acct_revoke(token_in const & in, cmd_persist &, postgres::pipeline & pl) {
+		if (session::is_session(in.token)) {
+			std::string id;
+			int64_t expires;
+			if (!session::revoke(in.token, id, expires)) {
+				return [](cmd_persist & pers) -> aeon::object {
+					aeon::object ret = begin_api_return(code::invalid_operation);
+					debugmsg("not a live session");
+					return ret;
+				};
+			}
+			size_t q = pl.queue(stmt_session_revoke, asterid::strf("s %s %lld", id.c_str(), static_cast<long long>(expires)));
+			return [&pl, q](cmd_persist & pers) -> aeon::object {
+				postgres::result & res = pl.get(q);
+				if (!res.tuples_ok()) sqlerror;
+				return begin_api_return(code::success);
+			};
 		}
-		pers.acct_id = res.get_value(0, 0);
-		aeon::object ret = begin_api_return(code::success);
-		ret["acct_id"] = pers.acct_id;
-		return ret;
+		std::string token_hash = util::hex(util::hash_blake2b(in.token));
+		size_t q = pl.queue(stmt_token_revoke, token_hash);
+		return [&pl, q, token_hash](cmd_persist & pers) -> aeon::object {
+			postgres::result & res = pl.get(q);
+			if (!res.tuples_ok()) sqlerror;
+			// only once the DELETE has committed, so no lookup can read the row afterwards and cache it again
+			// other instances hear about it through the NOTIFY
+			token_cache::invalidate(token_hash);
+			if (res.num_rows()) session::revoke_account(res.get<postgres::bigint_t>(0, 0), res.get<postgres::bigint_t>(0, 1));
+			return begin_api_return(code::success);
+		};
 	}
 	
 	// ================================
 	// ACCT_CLAIM -- claim an anonymous account
 	// ================================
-	static aeon::object acct_claim(aeon::object const & in, cmd_persist & pers) {
+	struct credentials_in {
+		std::string_view username;
+		std::string_view password;
+		static constexpr auto fields = std::make_tuple(required("username", &credentials_in::username), required("password", &credentials_in::password));
+	};
+	
+	static aeon::object acct_claim(credentials_in const & in, cmd_persist & pers) {
 		if (!pers.acct_id) {
 			aeon::object ret = begin_api_return(code::authorization_required);
 			debugmsg("not authorized, nothing to claim");
 			return ret;
 		}
-		postgres::result res = pers.dbv.exec_params("SELECT acct_id FROM account.auth WHERE acct_id = $1::BIGINT", {std::to_string(pers.acct_id)});
-		if (!res.tuples_ok()) sqlerror;
-		if (res.num_rows() != 0) {
-			aeon::object ret = begin_api_return(code::invalid_operation);
-			debugmsg("this account has already been claimed");
+		postgres::bigint_t salt = util::randomized<postgres::bigint_t>();
+		auto derived = kdf::derive(std::string {in.password}, salt);
+		if (!derived) {
+			aeon::object ret = begin_api_return(code::overloaded);
+			debugmsg("password hashing queue is full, try again later");
 			return ret;
 		}
-		std::string username = in["username"].string();
-		std::string password = in["password"].string();
-		if (!username.size()) {
-			aeon::object ret = begin_api_return(code::missing_field);
-			debugmsg("username required");
+		pers.detach(); // hashing takes far longer than any query, don't keep a connection idle through it
+		if (derived->wait_until(pers.deadline) != std::future_status::ready) {
+			aeon::object ret = begin_api_return(code::deadline_exceeded);
+			debugmsg("password hashing didn't finish in time");
 			return ret;
 		}
-		if (!password.size()) {
-			aeon::object ret = begin_api_return(code::missing_field);
-			debugmsg("password required");
+		std::string passhash;
+		try {
+			passhash = derived->get();
+		} catch (std::exception const & e) {
+			scilogve << e.what();
+			aeon::object ret = begin_api_return(code::database_error);
+			debugmsg("password hashing failed");
+			return ret;
+		}
+		if (!pers.attach()) {
+			aeon::object ret = begin_api_return(code::database_error);
+			debugmsg("no database connection came free after password hashing");
+			return ret;
+		}
+		// the unique constraints do the checking, so a concurrent claim of the same account or username can't slip through
+		postgres::result res = pers.exec_prepared(stmt_auth_insert, pers.acct_id, in.username, passhash, salt, kdf::current_scheme());
+		if (!res.cmd_ok()) {
+			if (res.get_sqlstate() != "23505") sqlerror; // unique_violation
+			aeon::object ret = begin_api_return(code::invalid_operation);
+			debugmsg(res.get_constraint() == "auth_username_key" ? "username already taken" : "this account has already been claimed");
 			return ret;
 		}
-		postgres::bigint_t salt = util::randomized<postgres::bigint_t>();
-		std::string passhash = util::hash_blake2b(password + std::to_string(salt)).hex();
-		res = pers.dbv.exec_params("INSERT INTO account.auth (acct_id, username, passhash, salt) VALUES ($1::BIGINT, $2::TEXT, $3::TEXT, $4::BIGINT)", {std::to_string(pers.acct_id), username, passhash, std::to_string(salt)});
-		if (!res.cmd_ok()) sqlerror;
 		return begin_api_return(code::success);
 	}
 	
 	// ================================
 	// ACCT_AUTH -- login to an account
 	// ================================
-	static aeon::object acct_auth(aeon::object const & in, cmd_persist & pers) {
-		std::string username = in["username"].string();
-		std::string password = in["password"].string();
-		if (!username.size()) {
-			aeon::object ret = begin_api_return(code::missing_field);
-			debugmsg("username required");
+	static aeon::object acct_auth(credentials_in const & in, cmd_persist & pers) {
+		postgres::result res = pers.exec_prepared(stmt_auth_lookup, in.username);
+		if (!res.tuples_ok()) sqlerror;
+		if (!res.num_rows()) {
+			aeon::object ret = begin_api_return(code::invalid_operation);
+			debugmsg("unrecognized username");
 			return ret;
 		}
-		if (!password.size()) {
-			aeon::object ret = begin_api_return(code::missing_field);
-			debugmsg("password required");
+		auto [acct_id, passhash, salt, scheme] = *res.rows<postgres::bigint_t, std::string_view, postgres::bigint_t, std::string_view>().begin();
+		auto verified = kdf::verify(std::string {in.password}, salt, std::string {scheme}, std::string {passhash});
+		if (!verified) {
+			aeon::object ret = begin_api_return(code::overloaded);
+			debugmsg("password hashing queue is full, try again later");
 			return ret;
 		}
-		postgres::result res = pers.dbv.exec_params("SELECT acct_id, passhash, salt FROM account.auth WHERE username = $1::TEXT", {username});
-		if (!res.tuples_ok()) sqlerror;
-		if (!res.num_fields()) {
-			aeon::object ret = begin_api_return(code::invalid_operation);
-			debugmsg("unrecognized username");
+		pers.detach();
+		if (verified->wait_until(pers.deadline) != std::future_status::ready) {
+			aeon::object ret = begin_api_return(code::deadline_exceeded);
+			debugmsg("password hashing didn't finish in time");
 			return ret;
 		}
-		std::string passhash = util::hash_blake2b(password + std::string(res(0, 2))).hex();
-		if (passhash != res(0, 1).string()) {
+		bool password_ok = false;
+		try {
+			password_ok = verified->get();
+		} catch (std::exception const & e) {
+			scilogve << e.what();
+		}
+		if (!password_ok) {
 			aeon::object ret = begin_api_return(code::invalid_operation);
 			debugmsg("incorrect password");
 			return ret;
 		}
-		pers.acct_id = res(0, 0);
-		std::string token_name = util::random_str(64, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789");
-		std::string token_hash = util::hash_blake2b(token_name).hex();
-		pers.dbv.cmd_params("UPDATE account.auth SET last_login = NOW() WHERE acct_id = $1::BIGINT", {std::to_string(pers.acct_id)});
-		res = pers.dbv.exec_params("INSERT INTO account.token (acct_id, hash) VALUES ($1::BIGINT, $2::TEXT)", {std::to_string(pers.acct_id), token_hash});
+		if (!pers.attach()) {
+			aeon::object ret = begin_api_return(code::database_error);
+			debugmsg("no database connection came free after password hashing");
+			return ret;
+		}
+		pers.acct_id = acct_id;
+		std::string token_name = util::random_str(token_length, token_chars);
+		std::string token_hash = util::hex(util::hash_blake2b(token_name));
+		res = pers.exec_prepared(stmt_auth_login, pers.acct_id, token_hash);
 		if (!res.cmd_ok()) sqlerror;
 		aeon::object ret = begin_api_return(code::success);
 		ret["token"] = token_name;
+		if (session::enabled()) ret["session"] = session::issue(pers.acct_id);
 		return ret;
 	}
 	
-	void auth_init(postgres::pool::conview & dbv) {
-		if (!dbv.cmd(R"(
-			CREATE SCHEMA IF NOT EXISTS account
-		)")) throwe(startup);
-		
-		// BASE
-		if (!dbv.cmd(R"(
+	static std::vector<migrate::migration> const migrations {
+		{1, "account schema", R"(
+			CREATE SCHEMA IF NOT EXISTS account;
+			
 			CREATE TABLE IF NOT EXISTS account.base (
 				id BIGSERIAL PRIMARY KEY,
 				seed BIGINT NOT NULL,
 				create_date TIMESTAMP NOT NULL DEFAULT NOW()
-			)
-		)")) throwe(startup);
-		
-		// AUTH
-		if (!dbv.cmd(R"(
+			);
+			
 			CREATE TABLE IF NOT EXISTS account.auth (
 				acct_id BIGINT REFERENCES account.base(id) NOT NULL UNIQUE,
 				username VARCHAR(64) NOT NULL UNIQUE,
 				passhash CHAR(128) NOT NULL,
 				salt BIGINT NOT NULL,
 				last_login TIMESTAMP
-			)
-		)")) throwe(startup);
-		
-		// TOKEN
-		if (!dbv.cmd(R"(
+			);
+			
 			CREATE TABLE IF NOT EXISTS account.token (
 				acct_id BIGINT REFERENCES account.base(id) NOT NULL,
 				hash CHAR(128) NOT NULL UNIQUE,
 				last_use TIMESTAMP
-				
-			)
-		)")) throwe(startup);
-		if (!dbv.cmd(R"(
-			CREATE INDEX IF NOT EXISTS token_acct_id_idx
-			ON account.token(acct_id)
-		)")) throwe(startup);
+			);
+			
+			CREATE INDEX IF NOT EXISTS token_acct_id_idx ON account.token(acct_id);
+		)"},
+		{2, "auth kdf scheme", R"(
+			ALTER TABLE account.auth ADD COLUMN IF NOT EXISTS kdf TEXT NOT NULL DEFAULT 'blake2b';
+		)"},
+	};
+	
+	void auth_init(postgres::pool::conview & dbv) {
+		// the first migration is idempotent so databases created before migrations existed adopt it cleanly
+		migrate::apply(dbv, "account", migrations);
+		
+		bulk_create_max = std::max<long long>(util::setting_int("BULK_CREATE_MAX", 10000), 1);
+		provision_key = util::setting("PROVISION_KEY");
 		
-		register_cmd("acct_create", acct_create);
-		register_cmd("acct_token", acct_token);
-		register_cmd("acct_claim", acct_claim);
-		register_cmd("acct_auth", acct_auth);
+		register_cmd_pipelined(cmd_id::acct_create, "acct_create", acct_create, false);
+		register_cmd_pipelined(cmd_id::acct_token, "acct_token", typed<token_in, acct_token>, false);
+		register_cmd_pipelined(cmd_id::acct_revoke, "acct_revoke", typed<token_in, acct_revoke>, false, true);
+		if (!provision_key.empty()) register_cmd_pipelined(cmd_id::acct_create_bulk, "acct_create_bulk", typed<create_bulk_in, acct_create_bulk>, false, true);
+		register_cmd(cmd_id::acct_claim, "acct_claim", typed<credentials_in, acct_claim>);
+		register_cmd(cmd_id::acct_auth, "acct_auth", typed<credentials_in, acct_auth>);
 	}
 }
@@ -3,7 +3,7 @@
 #include "psql.hh"
 
 #define debugmsg(msg) if (pers.debug_mode) ret["debug"] = msg
-#define sqlerror do {aeon::object ret = begin_api_return(code::database_error); debugmsg(res.get_error()); scilogvs << res.get_error(); return ret;} while (0)
+#define sqlerror do {aeon::object ret = begin_api_return(res.get_sqlstate() == "57014" ? code::deadline_exceeded : code::database_error); debugmsg(res.get_error()); scilogvs << res.get_error(); return ret;} while (0)
 
 namespace aeon = asterid::aeon;
 
@@ -12,7 +12,19 @@ namespace rainboa::api {
 	struct cmd_persist {
 		bool debug_mode;
 		postgres::bigint_t acct_id;
-		postgres::pool::conview dbv;
+		postgres::pool::conview dbv; // always the primary, empty while detached
+		deadline_t deadline;
+		postgres::pool::conview replica {}; // taken on the first read_only statement, if there are replicas
+		bool wrote = false; // once set, reads stay on the primary so the session sees its own writes
+		size_t provisioned = 0; // accounts requested by acct_create_bulk so far in this request
+		
+		// runs read_only statements on a replica where it can, everything else on the primary
+		postgres::pool::conview & route(postgres::statement const & stmt);
+		template <typename ... Ts> inline postgres::result exec_prepared(postgres::statement const & stmt, Ts const & ... args) { return route(stmt).exec_prepared(stmt, args ...); }
+		// hands the connections back to the pool across a long wait that doesn't need them, like password hashing
+		// only synchronous commands may detach, nothing can be left queued on the connection
+		void detach();
+		bool attach(); // takes a primary connection again if detached, false if none came free before the deadline
 	};
 
 	enum struct code : aeon::int_t {
@@ -23,13 +35,125 @@ namespace rainboa::api {
 		invalid_operation,
 		database_error,
 		authorization_required,
+		overloaded,
+		session_expired,
+		deadline_exceeded,
 	};
 	
-	typedef std::function<aeon::object(aeon::object const &, cmd_persist &)> api_f;
+	// stable wire ids, application/aeon clients may send these in place of the command name
+	// never renumber, only append
+	enum struct cmd_id : aeon::int_t {
+		debug,
+		acct_create,
+		acct_token,
+		acct_claim,
+		acct_auth,
+		acct_revoke,
+		acct_create_bulk,
+	};
+	
+	typedef aeon::object (*api_f)(aeon::object const &, cmd_persist &);
+	
+	// pipelined commands are split in two: the queue half validates input and queues its statements, the returned finish half
+	// runs once the batch's pipeline has been collected and turns the results into the command's return value
+	// finish halves run in request order, so they are free to update the session
+	typedef std::function<aeon::object(cmd_persist &)> api_finish_f;
+	typedef api_finish_f (*api_queue_f)(aeon::object const &, cmd_persist &, postgres::pipeline &);
 	
 	aeon::object begin_api_return(code);
-	void register_cmd(std::string const & cmd, api_f);
+	// commands can only be registered during init(), the table is frozen before the first request
+	void register_cmd(cmd_id, std::string const & cmd, api_f);
+	// reads_session: the queue half depends on session state set by earlier commands
+	// barrier: the command writes rows later commands may read, so it runs alone, after everything before it and before anything after it
+	// commands without either are fanned out over several connections and must not depend on one another's effects
+	void register_cmd_pipelined(cmd_id, std::string const & cmd, api_queue_f, bool reads_session, bool barrier = false);
+	
+	// ================================
+	// TYPED INPUT
+	// ================================
+	
+	// a command's input is a plain struct listing its fields in a static constexpr tuple named fields:
+	//   struct claim_in {
+	//     std::string_view username;
+	//     static constexpr auto fields = std::make_tuple(required("username", &claim_in::username));
+	//   };
+	// string fields are views into the request, which outlives the command, nothing is copied
+	namespace decode_internal {
+		template <typename S, typename T> struct field {
+			char const * name;
+			T S::* member;
+			bool required; // required strings must also be non-empty
+		};
+		
+		inline bool decode_value(aeon::object const & o, std::string_view & v) { if (!o.is_string()) return false; v = o.string(); return !v.empty(); }
+		inline bool decode_value(aeon::object const & o, aeon::int_t & v) { if (!o.is_int()) return false; v = o.integer(); return true; }
+		
+		template <typename S, typename T> inline bool decode_field(aeon::object const & in, S & out, field<S, T> const & f, char const * & missing) {
+			if (decode_value(in[f.name], out.*f.member) || !f.required) return true;
+			missing = f.name;
+			return false;
+		}
+		
+		template <typename S> inline bool decode(aeon::object const & in, S & out, char const * & missing) {
+			return std::apply([&](auto const & ... f){ return (decode_field(in, out, f, missing) && ...); }, S::fields);
+		}
+		
+		inline aeon::object missing_field(char const * name, cmd_persist & pers) {
+			aeon::object ret = begin_api_return(code::missing_field);
+			debugmsg(std::string {name} + " required");
+			return ret;
+		}
+	}
+	
+	template <typename S, typename T> constexpr decode_internal::field<S, T> required(char const * name, T S::* member) { return {name, member, true}; }
+	template <typename S, typename T> constexpr decode_internal::field<S, T> optional(char const * name, T S::* member) { return {name, member, false}; }
+	
+	// adapt handlers taking a decoded struct to the plain api_f / api_queue_f signatures, input that fails to decode never reaches them
+	template <typename S, aeon::object (*F)(S const &, cmd_persist &)> aeon::object typed(aeon::object const & in, cmd_persist & pers) {
+		S s {};
+		char const * missing = nullptr;
+		if (!decode_internal::decode(in, s, missing)) return decode_internal::missing_field(missing, pers);
+		return F(s, pers);
+	}
+	template <typename S, api_finish_f (*F)(S const &, cmd_persist &, postgres::pipeline &)> api_finish_f typed(aeon::object const & in, cmd_persist & pers, postgres::pipeline & pl) {
+		S s {};
+		char const * missing = nullptr;
+		if (!decode_internal::decode(in, s, missing)) return [missing](cmd_persist & pers){ return decode_internal::missing_field(missing, pers); };
+		return F(s, pers, pl);
+	}
 	
 	void auth_init(postgres::pool::conview & dbv);
 	
+	// in-process cache of token hash -> account id, last_use is written behind in periodic batches
+	// revocations reach every instance through NOTIFY on token_cache::revoke_channel
+	namespace token_cache {
+		static constexpr char const * revoke_channel = "rainboa_token_revoke";
+		void init(postgres::pool & pool, std::string const & conninfo); // conninfo for the dedicated LISTEN connection
+		void term(); // stops the flusher and writes out anything still pending
+		bool lookup(std::string const & hash, postgres::bigint_t & acct_id);
+		void insert(std::string const & hash, postgres::bigint_t acct_id);
+		void invalidate(std::string const & hash); // also keeps the hash out of the cache for a TTL, in case a lookup that raced the revoke finishes late
+	}
+	
+	// stateless session tokens, HMAC signed with RAINBOA_TOKEN_KEY and checked without touching the database
+	// they expire after RAINBOA_SESSION_TTL_S, revocations are held in memory until then and reach other instances through token_cache's NOTIFY listener
+	namespace session {
+		enum struct status {
+			ok,
+			invalid,
+			expired,
+			revoked,
+		};
+		
+		void init(); // leaves sessions disabled if no key is configured
+		bool enabled();
+		bool is_session(std::string_view token); // shape only, says nothing about validity
+		std::string issue(postgres::bigint_t acct_id);
+		status verify(std::string_view token, postgres::bigint_t & acct_id);
+		// refuses one live session from now on, id and expires are what other instances need to pass to deny()
+		bool revoke(std::string_view token, std::string & id, int64_t & expires);
+		void deny(std::string const & id, int64_t expires);
+		void revoke_account(postgres::bigint_t acct_id, int64_t before); // every session of the account issued at or before this unix time
+	}
+	
 }
@@ -0,0 +1,175 @@
+#include "api_internal.hh"
+
+#include <botan/mac.h>
+#include <botan/mem_ops.h>
+
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <shared_mutex>
+
+namespace rainboa::api::session {
+	
+	// "s2" + hex(acct_id) + hex(issued) + hex(expiry) + hex(truncated HMAC-SHA256 of all three), all big endian
+	static constexpr std::string_view prefix = "s2";
+	static constexpr size_t payload_size = 24;
+	static constexpr size_t tag_size = 16;
+	static constexpr size_t token_size = prefix.size() + (payload_size + tag_size) * 2;
+	
+	static std::string key;
+	static int64_t ttl;
+	
+	// revocations, each entry is dropped once every session it could refuse has expired anyway
+	static std::shared_mutex revoked_m;
+	static std::unordered_map<postgres::bigint_t, int64_t> not_before; // account -> sessions issued at or before this are refused
+	static std::deque<std::pair<int64_t, postgres::bigint_t>> not_before_order; // oldest first, for pruning
+	static std::unordered_map<std::string, int64_t> denied; // revocation id of a single session -> its expiry
+	static std::deque<std::pair<int64_t, std::string>> denied_order;
+	
+	// HMAC objects hold their key schedule and running state, so every thread keys its own on first use
+	static Botan::MessageAuthenticationCode & mac() {
+		static thread_local std::unique_ptr<Botan::MessageAuthenticationCode> m = [](){
+			auto m = Botan::MessageAuthenticationCode::create("HMAC(SHA-256)");
+			m->set_key(reinterpret_cast<uint8_t const *>(key.data()), key.size());
+			return m;
+		}();
+		return *m;
+	}
+	
+	static void sign(uint8_t const * payload, uint8_t * tag) {
+		Botan::MessageAuthenticationCode & m = mac();
+		uint8_t full[32];
+		m.update(payload, payload_size);
+		m.final(full);
+		memcpy(tag, full, tag_size);
+	}
+	
+	static inline int unhex_digit(char c) {
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		return -1;
+	}
+	
+	static bool unhex(std::string_view str, uint8_t * out) {
+		for (size_t i = 0; i < str.size() / 2; i++) {
+			int hi = unhex_digit(str[i * 2]), lo = unhex_digit(str[i * 2 + 1]);
+			if (hi < 0 || lo < 0) return false;
+			out[i] = hi << 4 | lo;
+		}
+		return true;
+	}
+	
+	static inline void put_be64(uint8_t * out, uint64_t v) {
+		for (int i = 7; i >= 0; i--, v >>= 8) out[i] = v & 0xFF;
+	}
+	
+	static inline uint64_t get_be64(uint8_t const * in) {
+		uint64_t v = 0;
+		for (int i = 0; i < 8; i++) v = v << 8 | in[i];
+		return v;
+	}
+	
+	// with revoked_m held exclusively
+	static void prune(int64_t now) {
+		while (!not_before_order.empty() && not_before_order.front().first + ttl < now) {
+			auto i = not_before.find(not_before_order.front().second);
+			if (i != not_before.end() && i->second + ttl < now) not_before.erase(i);
+			not_before_order.pop_front();
+		}
+		while (!denied_order.empty() && denied_order.front().first < now) {
+			denied.erase(denied_order.front().second);
+			denied_order.pop_front();
+		}
+	}
+	
+	// the token itself never leaves the process, other instances only need something to match it by
+	static std::string revocation_id(std::string_view token) {
+		return util::hex(util::hash_blake2b(token));
+	}
+	
+	static bool is_revoked(std::string_view token, postgres::bigint_t acct_id, int64_t issued) {
+		std::shared_lock<std::shared_mutex> lk {revoked_m};
+		auto i = not_before.find(acct_id);
+		if (i != not_before.end() && issued <= i->second) return true;
+		return !denied.empty() && denied.count(revocation_id(token));
+	}
+	
+	void init() {
+		key = util::setting("TOKEN_KEY");
+		ttl = util::setting_int("SESSION_TTL_S", 3600);
+		if (key.empty()) {
+			scilogi << "RAINBOA_TOKEN_KEY not set, session tokens disabled";
+			return;
+		}
+		if (key.size() < 32) {
+			scilogve << "RAINBOA_TOKEN_KEY must be at least 32 bytes";
+			throwe(startup);
+		}
+		if (!Botan::MessageAuthenticationCode::create("HMAC(SHA-256)")) {
+			scilogve << "HMAC(SHA-256) unavailable";
+			throwe(startup);
+		}
+	}
+	
+	bool enabled() {
+		return !key.empty();
+	}
+	
+	bool is_session(std::string_view token) {
+		return token.size() == token_size && token.substr(0, prefix.size()) == prefix;
+	}
+	
+	std::string issue(postgres::bigint_t acct_id) {
+		uint8_t buf[payload_size + tag_size];
+		int64_t now = time(nullptr);
+		put_be64(buf, acct_id);
+		put_be64(buf + 8, now);
+		put_be64(buf + 16, now + ttl);
+		sign(buf, buf + payload_size);
+		std::string ret {prefix};
+		ret += util::hex(buf, sizeof(buf));
+		return ret;
+	}
+	
+	status verify(std::string_view token, postgres::bigint_t & acct_id) {
+		if (!enabled() || !is_session(token)) return status::invalid;
+		uint8_t buf[payload_size + tag_size];
+		if (!unhex(token.substr(prefix.size()), buf)) return status::invalid;
+		uint8_t tag[tag_size];
+		sign(buf, tag);
+		if (!Botan::constant_time_compare(tag, buf + payload_size, tag_size)) return status::invalid;
+		if (static_cast<int64_t>(get_be64(buf + 16)) < time(nullptr)) return status::expired;
+		if (is_revoked(token, get_be64(buf), get_be64(buf + 8))) return status::revoked;
+		acct_id = get_be64(buf);
+		return status::ok;
+	}
+	
+	bool revoke(std::string_view token, std::string & id, int64_t & expires) {
+		postgres::bigint_t acct_id;
+		if (verify(token, acct_id) != status::ok) return false;
+		uint8_t buf[payload_size + tag_size];
+		unhex(token.substr(prefix.size()), buf);
+		id = revocation_id(token);
+		expires = get_be64(buf + 16);
+		deny(id, expires);
+		return true;
+	}
+	
+	void deny(std::string const & id, int64_t expires) {
+		int64_t now = time(nullptr);
+		if (expires < now) return;
+		std::lock_guard<std::shared_mutex> lk {revoked_m};
+		prune(now);
+		if (denied.emplace(id, expires).second) denied_order.emplace_back(expires, id);
+	}
+	
+	void revoke_account(postgres::bigint_t acct_id, int64_t before) {
+		int64_t now = time(nullptr);
+		before = std::max(before, now); // the database's clock and ours may disagree, never refuse less than everything issued here so far
+		std::lock_guard<std::shared_mutex> lk {revoked_m};
+		prune(now);
+		int64_t & nb = not_before[acct_id];
+		nb = std::max(nb, before);
+		not_before_order.emplace_back(nb, acct_id);
+	}
+}
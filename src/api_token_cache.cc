@@ -0,0 +1,210 @@
+#include "api_internal.hh"
+
+#include <deque>
+#include <list>
+#include <unordered_set>
+
+namespace rainboa::api::token_cache {
+	
+	static constexpr size_t num_shards = 16;
+	static constexpr size_t flush_chunk = 1000;
+	
+	typedef std::chrono::steady_clock clock;
+	
+	struct shard {
+		struct entry {
+			postgres::bigint_t acct_id;
+			clock::time_point expires;
+			std::list<std::string>::iterator lru_i;
+		};
+		std::mutex m;
+		std::unordered_map<std::string, entry> entries;
+		std::list<std::string> lru; // most recently used at the front
+		std::unordered_set<std::string> touched; // used since the last flush
+		std::unordered_map<std::string, clock::time_point> tombstones; // recently revoked, insert() refuses these until they expire
+		std::deque<std::pair<clock::time_point, std::string>> tombstone_order; // oldest first, for pruning
+	};
+	
+	static shard shards[num_shards];
+	static size_t shard_capacity;
+	static clock::duration ttl;
+	static clock::duration tombstone_ttl; // keep at least RAINBOA_REQUEST_TIMEOUT_MAX_MS
+	static clock::duration flush_interval;
+	
+	static postgres::pool * pool = nullptr;
+	static std::string listen_conninfo;
+	static std::thread flusher, listener;
+	static std::mutex flusher_m;
+	static std::condition_variable flusher_cv;
+	static std::atomic<bool> run {false};
+	
+	static postgres::statement const stmt_touch {"acct_token_touch", "UPDATE account.token SET last_use = NOW() WHERE hash = ANY($1::BPCHAR[])"};
+	
+	static inline shard & shard_for(std::string const & hash) {
+		return shards[std::hash<std::string>{}(hash) % num_shards];
+	}
+	
+	static void flush() {
+		std::vector<std::string> hashes;
+		for (shard & sh : shards) {
+			std::lock_guard<std::mutex> lk {sh.m};
+			hashes.insert(hashes.end(), sh.touched.begin(), sh.touched.end());
+			sh.touched.clear();
+		}
+		if (hashes.empty()) return;
+		
+		auto dbv = pool->acquire();
+		if (!dbv.ok()) {
+			scilogve << asterid::strf("could not acquire a connection, dropping %zu last_use updates", hashes.size());
+			return;
+		}
+		for (size_t i = 0; i < hashes.size(); i += flush_chunk) {
+			std::vector<std::string> chunk (hashes.begin() + i, hashes.begin() + std::min(i + flush_chunk, hashes.size()));
+			dbv.cmd_prepared(stmt_touch, chunk);
+		}
+	}
+	
+	static void flush_loop() {
+		std::unique_lock<std::mutex> lk {flusher_m};
+		while (run) {
+			flusher_cv.wait_for(lk, flush_interval);
+			lk.unlock();
+			flush();
+			lk.lock();
+		}
+	}
+	
+	static void clear() {
+		for (shard & sh : shards) {
+			std::lock_guard<std::mutex> lk {sh.m};
+			sh.entries.clear();
+			sh.lru.clear();
+		}
+	}
+	
+	// payloads are written by acct_revoke, see there
+	static void apply_revocation(std::string_view payload) {
+		std::string str {payload};
+		char hash[129];
+		long long acct_id, at;
+		if (sscanf(str.c_str(), "t %128s %lld %lld", hash, &acct_id, &at) == 3) {
+			invalidate(hash);
+			session::revoke_account(acct_id, at);
+		} else if (sscanf(str.c_str(), "s %128s %lld", hash, &at) == 2) {
+			session::deny(hash, at);
+		} else {
+			scilogvw << "unrecognized token revocation: " << str;
+		}
+	}
+	
+	// a dedicated connection, LISTEN only lasts as long as the session it was issued on
+	static void listen_loop() {
+		std::unique_ptr<postgres::connection> con;
+		while (run) {
+			if (!con) {
+				con.reset(new postgres::connection {listen_conninfo});
+				if (!con->ok() || !con->cmd(std::string {"LISTEN "} + revoke_channel)) {
+					con.reset();
+					std::unique_lock<std::mutex> lk {flusher_m};
+					flusher_cv.wait_for(lk, std::chrono::seconds {1}, [](){ return !run; });
+					continue;
+				}
+				clear(); // revocations sent while nobody was listening were missed, anything cached may be stale
+			}
+			bool ok = con->wait_notifications(std::chrono::milliseconds {500}, [](std::string_view, std::string_view payload){
+				apply_revocation(payload);
+			});
+			if (!ok) {
+				scilogvw << "lost the token revocation listener, reconnecting";
+				con.reset();
+			}
+		}
+	}
+	
+	void init(postgres::pool & p, std::string const & conninfo) {
+		pool = &p;
+		listen_conninfo = conninfo;
+		shard_capacity = std::max<long long>(util::setting_int("TOKEN_CACHE_SIZE", 65536) / num_shards, 1);
+		ttl = std::chrono::seconds {util::setting_int("TOKEN_CACHE_TTL_S", 60)};
+		tombstone_ttl = std::chrono::seconds {util::setting_int("TOKEN_TOMBSTONE_S", 60)};
+		flush_interval = std::chrono::seconds {util::setting_int("TOKEN_FLUSH_INTERVAL_S", 5)};
+		run = true;
+		flusher = std::thread {flush_loop};
+		listener = std::thread {listen_loop};
+	}
+	
+	void term() {
+		if (!flusher.joinable()) return;
+		{
+			std::lock_guard<std::mutex> lk {flusher_m};
+			run = false;
+		}
+		flusher_cv.notify_all();
+		flusher.join(); // flushes on the way out
+		listener.join();
+		clear();
+		for (shard & sh : shards) {
+			std::lock_guard<std::mutex> lk {sh.m};
+			sh.tombstones.clear();
+			sh.tombstone_order.clear();
+		}
+		pool = nullptr;
+	}
+	
+	bool lookup(std::string const & hash, postgres::bigint_t & acct_id) {
+		shard & sh = shard_for(hash);
+		std::lock_guard<std::mutex> lk {sh.m};
+		auto i = sh.entries.find(hash);
+		if (i == sh.entries.end()) return false;
+		if (clock::now() > i->second.expires) {
+			// expired entries are re-validated against the database, which catches tokens revoked by other instances
+			sh.lru.erase(i->second.lru_i);
+			sh.entries.erase(i);
+			return false;
+		}
+		sh.lru.splice(sh.lru.begin(), sh.lru, i->second.lru_i);
+		sh.touched.insert(hash);
+		acct_id = i->second.acct_id;
+		return true;
+	}
+	
+	void insert(std::string const & hash, postgres::bigint_t acct_id) {
+		shard & sh = shard_for(hash);
+		std::lock_guard<std::mutex> lk {sh.m};
+		auto t = sh.tombstones.find(hash);
+		if (t != sh.tombstones.end() && clock::now() < t->second) return;
+		sh.touched.insert(hash);
+		auto i = sh.entries.find(hash);
+		if (i != sh.entries.end()) {
+			i->second.acct_id = acct_id;
+			i->second.expires = clock::now() + ttl;
+			sh.lru.splice(sh.lru.begin(), sh.lru, i->second.lru_i);
+			return;
+		}
+		if (sh.entries.size() >= shard_capacity) {
+			sh.entries.erase(sh.lru.back());
+			sh.lru.pop_back();
+		}
+		sh.lru.push_front(hash);
+		sh.entries[hash] = {acct_id, clock::now() + ttl, sh.lru.begin()};
+	}
+	
+	void invalidate(std::string const & hash) {
+		shard & sh = shard_for(hash);
+		clock::time_point now = clock::now();
+		std::lock_guard<std::mutex> lk {sh.m};
+		// a lookup that read the row before the DELETE committed finishes within its request's deadline, the tombstone has to outlast that
+		while (!sh.tombstone_order.empty() && sh.tombstone_order.front().first <= now) {
+			auto t = sh.tombstones.find(sh.tombstone_order.front().second);
+			if (t != sh.tombstones.end() && t->second <= now) sh.tombstones.erase(t);
+			sh.tombstone_order.pop_front();
+		}
+		sh.tombstones[hash] = now + tombstone_ttl;
+		sh.tombstone_order.emplace_back(now + tombstone_ttl, hash);
+		sh.touched.erase(hash);
+		auto i = sh.entries.find(hash);
+		if (i == sh.entries.end()) return;
+		sh.lru.erase(i->second.lru_i);
+		sh.entries.erase(i);
+	}
+}
@@ -0,0 +1,420 @@
+#include "admission.hh"
+#include "api.hh"
+
+#include <algorithm>
+#include <map>
+#include <random>
+
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// rainboa_bench -- throughput and tail latency for the API, plus microbenchmarks of the hot helpers
+//
+//   rainboa_bench micro
+//   rainboa_bench api  [options]   drives rainboa::api::process in process, needs a local postgres
+//   rainboa_bench http [options]   drives a running server over HTTP/1.1 keep-alive
+//
+// options:
+//   --mix=create:1,token:8,auth:1,claim:0   relative command weights
+//   --batch=N        commands per request (default 1)
+//   --threads=N      concurrent clients (default 4)
+//   --seconds=N      measurement length (default 10)
+//   --accounts=N     accounts provisioned up front for token/auth (default 100)
+//   --aeon           send application/aeon bodies instead of JSON (http only)
+//   --host=H --port=P                        (http only, default 127.0.0.1:8081)
+
+namespace aeon = asterid::aeon;
+typedef std::chrono::steady_clock bclock;
+
+// ================================
+// OPTIONS
+// ================================
+
+struct options {
+	std::map<std::string, unsigned> mix {{"create", 1}, {"token", 8}, {"auth", 1}, {"claim", 0}};
+	unsigned batch = 1;
+	unsigned threads = 4;
+	unsigned seconds = 10;
+	unsigned accounts = 100;
+	bool aeon_body = false;
+	std::string host = "127.0.0.1";
+	std::string port = "8081";
+};
+
+static bool parse_options(int argc, char * * argv, options & opt) {
+	for (int i = 2; i < argc; i++) {
+		std::string arg = argv[i];
+		size_t eq = arg.find('=');
+		std::string key = arg.substr(0, eq), val = eq == std::string::npos ? "" : arg.substr(eq + 1);
+		if (key == "--batch") opt.batch = std::stoul(val);
+		else if (key == "--threads") opt.threads = std::stoul(val);
+		else if (key == "--seconds") opt.seconds = std::stoul(val);
+		else if (key == "--accounts") opt.accounts = std::stoul(val);
+		else if (key == "--aeon") opt.aeon_body = true;
+		else if (key == "--host") opt.host = val;
+		else if (key == "--port") opt.port = val;
+		else if (key == "--mix") {
+			for (auto & [k, v] : opt.mix) v = 0;
+			std::stringstream ss {val};
+			std::string item;
+			while (std::getline(ss, item, ',')) {
+				size_t c = item.find(':');
+				if (c == std::string::npos || !opt.mix.count(item.substr(0, c))) return false;
+				opt.mix[item.substr(0, c)] = std::stoul(item.substr(c + 1));
+			}
+		} else return false;
+	}
+	return opt.batch && opt.threads && opt.seconds;
+}
+
+// ================================
+// REPORTING
+// ================================
+
+struct latencies {
+	std::vector<uint64_t> ns;
+	uint64_t requests = 0;
+	uint64_t commands = 0;
+	uint64_t errors = 0;
+	void merge(latencies const & other) {
+		ns.insert(ns.end(), other.ns.begin(), other.ns.end());
+		requests += other.requests;
+		commands += other.commands;
+		errors += other.errors;
+	}
+};
+
+static double percentile(std::vector<uint64_t> & sorted, double p) {
+	if (sorted.empty()) return 0;
+	size_t idx = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+	return sorted[idx] / 1e6;
+}
+
+static void report(char const * what, latencies & l, double seconds) {
+	std::sort(l.ns.begin(), l.ns.end());
+	printf("%-24s %10.1f req/s %10.1f cmd/s   p50 %8.3f ms   p99 %8.3f ms   p999 %8.3f ms   errors %llu\n",
+		what, l.requests / seconds, l.commands / seconds, percentile(l.ns, 0.5), percentile(l.ns, 0.99), percentile(l.ns, 0.999), (unsigned long long)l.errors);
+}
+
+template <typename F> static void micro(char const * what, size_t iterations, F && func) {
+	auto start = bclock::now();
+	for (size_t i = 0; i < iterations; i++) func();
+	double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(bclock::now() - start).count();
+	printf("%-32s %12.1f ns/op\n", what, ns / iterations);
+}
+
+// ================================
+// WORKLOAD
+// ================================
+
+struct account {
+	std::string token;
+	std::string username;
+	std::string password;
+};
+
+struct workload {
+	options const & opt;
+	std::vector<account> accounts;
+	std::vector<std::string> weighted; // one entry per unit of weight
+	
+	workload(options const & opt) : opt(opt) {
+		for (auto const & [cmd, w] : opt.mix) for (unsigned i = 0; i < w; i++) weighted.push_back(cmd);
+	}
+	
+	aeon::object make_cmd(std::string const & kind, std::mt19937_64 & rng) const {
+		aeon::object obj = aeon::map();
+		account const & a = accounts.empty() ? account {} : accounts[rng() % accounts.size()];
+		if (kind == "create") {
+			obj["cmd"] = "acct_create";
+		} else if (kind == "token") {
+			obj["cmd"] = "acct_token";
+			obj["token"] = a.token;
+		} else if (kind == "auth") {
+			obj["cmd"] = "acct_auth";
+			obj["username"] = a.username;
+			obj["password"] = a.password;
+		} else if (kind == "claim") {
+			// claims a fresh anonymous account, the create is part of the cost
+			obj["cmd"] = "acct_claim";
+			obj["username"] = rainboa::util::random_str(24, "abcdefghijklmnopqrstuvwxyz");
+			obj["password"] = "benchmark";
+		}
+		return obj;
+	}
+	
+	aeon::object make_request(std::mt19937_64 & rng, unsigned & num_cmds) const {
+		aeon::object req = aeon::array();
+		num_cmds = 0;
+		for (unsigned i = 0; i < opt.batch; i++) {
+			std::string const & kind = weighted[rng() % weighted.size()];
+			if (kind == "claim") {
+				aeon::object create = aeon::map();
+				create["cmd"] = "acct_create";
+				req.array().push_back(create);
+				num_cmds++;
+			}
+			req.array().push_back(make_cmd(kind, rng));
+			num_cmds++;
+		}
+		return req;
+	}
+};
+
+static unsigned count_errors(aeon::object const & res) {
+	unsigned errors = 0;
+	for (aeon::object const & r : res.array()) {
+		if (!r.is_map() || r["err"].integer() != 0) errors++;
+	}
+	return errors;
+}
+
+template <typename F> static latencies run_clients(options const & opt, workload const & wl, F && send) {
+	std::vector<latencies> results (opt.threads);
+	std::vector<std::thread> threads;
+	auto end = bclock::now() + std::chrono::seconds {opt.seconds};
+	for (unsigned t = 0; t < opt.threads; t++) {
+		threads.emplace_back([&, t](){
+			std::mt19937_64 rng {t * 7919 + 1};
+			latencies & l = results[t];
+			while (bclock::now() < end) {
+				unsigned num_cmds;
+				aeon::object req = wl.make_request(rng, num_cmds);
+				auto start = bclock::now();
+				unsigned errors = send(t, req);
+				l.ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(bclock::now() - start).count());
+				l.requests++;
+				l.commands += num_cmds;
+				l.errors += errors;
+			}
+		});
+	}
+	for (auto & th : threads) th.join();
+	latencies total;
+	for (auto & l : results) total.merge(l);
+	return total;
+}
+
+// ================================
+// HTTP CLIENT
+// ================================
+
+struct http_client {
+	int fd = -1;
+	std::string buf;
+	
+	~http_client() { if (fd >= 0) close(fd); }
+	
+	bool connect(std::string const & host, std::string const & port) {
+		addrinfo hints {}, * res;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res)) return false;
+		fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		bool ok = fd >= 0 && !::connect(fd, res->ai_addr, res->ai_addrlen);
+		freeaddrinfo(res);
+		int one = 1;
+		if (ok) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		return ok;
+	}
+	
+	// returns the response body, empty on failure
+	std::string post(std::string const & content_type, std::string_view body) {
+		std::string req = "POST / HTTP/1.1\r\nHost: bench\r\nContent-Type: " + content_type + "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+		req.append(body);
+		for (size_t sent = 0; sent < req.size();) {
+			ssize_t n = send(fd, req.data() + sent, req.size() - sent, MSG_NOSIGNAL);
+			if (n <= 0) return {};
+			sent += n;
+		}
+		size_t head_end, content_length = 0;
+		while ((head_end = buf.find("\r\n\r\n")) == std::string::npos) if (!fill()) return {};
+		std::string head = buf.substr(0, head_end);
+		std::transform(head.begin(), head.end(), head.begin(), ::tolower);
+		size_t cl = head.find("content-length:");
+		if (cl != std::string::npos) content_length = std::stoul(head.substr(cl + 15));
+		while (buf.size() < head_end + 4 + content_length) if (!fill()) return {};
+		std::string res = buf.substr(head_end + 4, content_length);
+		buf.erase(0, head_end + 4 + content_length);
+		return res;
+	}
+	
+private:
+	bool fill() {
+		char tmp[16384];
+		ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+		if (n <= 0) return false;
+		buf.append(tmp, n);
+		return true;
+	}
+};
+
+static aeon::object http_exchange(http_client & c, options const & opt, aeon::object const & req) {
+	try {
+		if (opt.aeon_body) {
+			asterid::buffer_assembly body {};
+			req.serialize_binary(body);
+			std::string res = c.post("application/aeon", {reinterpret_cast<char const *>(body.data()), body.size()});
+			asterid::buffer_assembly res_body {};
+			res_body.write(res.data(), res.size());
+			return aeon::object::parse_binary(res_body);
+		}
+		return aeon::object::parse_text(c.post("application/json", req.serialize_text()));
+	} catch (aeon::exception::parse &) {
+		return aeon::array();
+	}
+}
+
+// ================================
+// MODES
+// ================================
+
+template <typename F> static bool provision(workload & wl, F && exchange) {
+	if (!wl.opt.mix.at("token") && !wl.opt.mix.at("auth")) return true;
+	printf("provisioning %u accounts...\n", wl.opt.accounts);
+	for (unsigned i = 0; i < wl.opt.accounts; i++) {
+		account a;
+		a.username = "bench_" + rainboa::util::random_str(16, "abcdefghijklmnopqrstuvwxyz0123456789");
+		a.password = rainboa::util::random_str(16, "abcdefghijklmnopqrstuvwxyz0123456789");
+		aeon::object req = aeon::array();
+		aeon::object create = aeon::map(), claim = aeon::map();
+		create["cmd"] = "acct_create";
+		claim["cmd"] = "acct_claim";
+		claim["username"] = a.username;
+		claim["password"] = a.password;
+		req.array().push_back(create);
+		req.array().push_back(claim);
+		aeon::object res = exchange(req);
+		if (count_errors(res) || res.array().size() != 2) {
+			fprintf(stderr, "failed to provision benchmark accounts\n");
+			return false;
+		}
+		a.token = res.array()[0]["token"].string();
+		wl.accounts.push_back(std::move(a));
+	}
+	return true;
+}
+
+static int run_micro() {
+	std::string token = rainboa::util::random_str(64, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789");
+	micro("hash_blake2b (64 B)", 1000000, [&](){ volatile auto d = rainboa::util::hash_blake2b(token); (void)d; });
+	micro("hex(blake2b)", 1000000, [&](){ volatile auto h = rainboa::util::hex(rainboa::util::hash_blake2b(token)); (void)h; });
+	micro("random_str (64)", 1000000, [&](){ volatile auto s = rainboa::util::random_str(64, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789"); (void)s; });
+	micro("random_strs (1000 x 64) / token", 1000, [&](){ volatile auto s = rainboa::util::random_strs(1000, 64, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789"); (void)s; });
+	
+	aeon::object req = aeon::array();
+	for (int i = 0; i < 20; i++) {
+		aeon::object cmd = aeon::map();
+		cmd["cmd"] = "acct_token";
+		cmd["token"] = token;
+		req.array().push_back(cmd);
+	}
+	std::string text = req.serialize_text();
+	micro("aeon serialize_text (20 cmds)", 100000, [&](){ volatile auto s = req.serialize_text(); (void)s; });
+	micro("aeon parse_text (20 cmds)", 100000, [&](){ volatile auto o = aeon::object::parse_text(text); (void)o; });
+	micro("aeon serialize_binary (20 cmds)", 100000, [&](){ asterid::buffer_assembly b {}; req.serialize_binary(b); });
+	
+	{
+		// 16 clients against the default shape of 8 admitted and a 100 ms queue, each admitted request holds its slot for 20 ms
+		rainboa::admission::init(8, 16);
+		std::atomic<unsigned> admitted {0}, shed {0};
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < 16; t++) {
+			threads.emplace_back([&](){
+				for (int i = 0; i < 50; i++) {
+					rainboa::admission::ticket ticket = rainboa::admission::admit({});
+					if (!ticket) { shed++; continue; }
+					admitted++;
+					std::this_thread::sleep_for(std::chrono::milliseconds {20});
+				}
+			});
+		}
+		for (auto & th : threads) th.join();
+		printf("%-40s %u admitted, %u shed\n", "admission (16 thr/8, 20 ms hold)", admitted.load(), shed.load());
+	}
+	
+	postgres::pool::config cfg;
+	cfg.min_cons = cfg.max_cons = 4;
+	postgres::pool pool {"rainboa", cfg};
+	if (!pool.ok()) {
+		fprintf(stderr, "skipping pool::acquire, no database\n");
+		return 0;
+	}
+	micro("pool::acquire (uncontended)", 1000000, [&](){ auto v = pool.acquire(); });
+	
+	options opt;
+	latencies l;
+	std::vector<std::thread> threads;
+	std::mutex lm;
+	for (unsigned t = 0; t < 16; t++) {
+		threads.emplace_back([&](){
+			latencies local;
+			for (int i = 0; i < 20000; i++) {
+				auto start = bclock::now();
+				auto v = pool.acquire();
+				local.ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(bclock::now() - start).count());
+				local.requests++;
+				if (!v.ok()) local.errors++;
+			}
+			std::lock_guard<std::mutex> lk {lm};
+			l.merge(local);
+		});
+	}
+	auto start = bclock::now();
+	for (auto & th : threads) th.join();
+	report("pool::acquire (16 thr/4)", l, std::chrono::duration<double> {bclock::now() - start}.count());
+	return 0;
+}
+
+static int run_api(options const & opt) {
+	rainboa::api::init();
+	workload wl {opt};
+	if (!provision(wl, [](aeon::object const & req){ return rainboa::api::process(req); })) return 1;
+	latencies l = run_clients(opt, wl, [](unsigned, aeon::object const & req){ return count_errors(rainboa::api::process(req)); });
+	report("api::process", l, opt.seconds);
+	rainboa::api::term();
+	return 0;
+}
+
+static int run_http(options const & opt) {
+	std::vector<std::unique_ptr<http_client>> clients;
+	for (unsigned i = 0; i < opt.threads + 1; i++) {
+		clients.emplace_back(new http_client);
+		if (!clients.back()->connect(opt.host, opt.port)) {
+			fprintf(stderr, "could not connect to %s:%s\n", opt.host.c_str(), opt.port.c_str());
+			return 1;
+		}
+	}
+	workload wl {opt};
+	http_client & setup = *clients.back();
+	if (!provision(wl, [&](aeon::object const & req){ return http_exchange(setup, opt, req); })) return 1;
+	latencies l = run_clients(opt, wl, [&](unsigned t, aeon::object const & req){
+		aeon::object res = http_exchange(*clients[t], opt, req);
+		return res.array().size() ? count_errors(res) : opt.batch;
+	});
+	report(opt.aeon_body ? "http (aeon)" : "http (json)", l, opt.seconds);
+	return 0;
+}
+
+int main(int argc, char * * argv) {
+	options opt;
+	std::string mode = argc > 1 ? argv[1] : "";
+	if ((mode != "micro" && mode != "api" && mode != "http") || !parse_options(argc, argv, opt)) {
+		fprintf(stderr, "usage: %s micro|api|http [--mix=create:1,token:8,auth:1,claim:0] [--batch=N] [--threads=N] [--seconds=N] [--accounts=N] [--aeon] [--host=H] [--port=P]\n", argv[0]);
+		return 2;
+	}
+	rainboa::util::set_log_enabled(rainboa::util::log_level::info, false);
+	rainboa::util::init();
+	int ret = 1;
+	try {
+		if (mode == "micro") ret = run_micro();
+		else if (mode == "api") ret = run_api(opt);
+		else ret = run_http(opt);
+	} catche(startup) {
+		scilogvf << "startup exception occurred, cannot continue";
+	}
+	rainboa::util::term();
+	return ret;
+}
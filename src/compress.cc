@@ -0,0 +1,139 @@
+#include "compress.hh"
+
+#include <cstring>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace rainboa::compress;
+
+static size_t min_size;
+static int zlib_level;
+#ifdef HAVE_ZSTD
+static int zstd_level;
+#endif
+
+// one deflate stream per format per thread, deflateReset is far cheaper than deflateInit on every response
+struct zlib_stream {
+	z_stream zs {};
+	bool ok = false;
+	zlib_stream(int window_bits) {
+		ok = deflateInit2(&zs, zlib_level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+	}
+	~zlib_stream() { if (ok) deflateEnd(&zs); }
+};
+
+struct compress_context {
+	zlib_stream gzip {15 + 16}; // +16 asks zlib for the gzip wrapper
+	zlib_stream deflate {15}; // "deflate" in HTTP means the zlib wrapper, not raw deflate
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx * zstd = ZSTD_createCCtx();
+	~compress_context() { ZSTD_freeCCtx(zstd); }
+#endif
+	std::vector<uint8_t> out;
+};
+
+static compress_context & context() {
+	static thread_local compress_context ctx {};
+	return ctx;
+}
+
+static bool apply_zlib(zlib_stream & s, std::vector<uint8_t> & out, asterid::buffer_assembly const & body) {
+	if (!s.ok || deflateReset(&s.zs) != Z_OK) return false;
+	out.resize(deflateBound(&s.zs, body.size()));
+	s.zs.next_in = const_cast<Bytef *>(body.data());
+	s.zs.avail_in = body.size();
+	s.zs.next_out = out.data();
+	s.zs.avail_out = out.size();
+	if (deflate(&s.zs, Z_FINISH) != Z_STREAM_END) return false;
+	out.resize(s.zs.total_out);
+	return true;
+}
+
+void rainboa::compress::init() {
+	min_size = util::setting_int("COMPRESS_MIN_SIZE", 1024);
+	zlib_level = util::setting_int("COMPRESS_LEVEL", 6);
+#ifdef HAVE_ZSTD
+	zstd_level = util::setting_int("COMPRESS_ZSTD_LEVEL", 3);
+#endif
+}
+
+encoding rainboa::compress::negotiate(std::string_view accept) {
+	// q-values win, ties go to the better codec, which is the later enumerator
+	encoding best = encoding::identity;
+	double best_q = 0;
+	while (!accept.empty()) {
+		size_t comma = accept.find(',');
+		std::string_view item = accept.substr(0, comma);
+		accept = comma == std::string_view::npos ? std::string_view {} : accept.substr(comma + 1);
+		
+		double q = 1;
+		size_t semi = item.find(';');
+		if (semi != std::string_view::npos) {
+			size_t qpos = item.find("q=", semi);
+			if (qpos != std::string_view::npos) q = strtod(std::string {item.substr(qpos + 2)}.c_str(), nullptr);
+			item = item.substr(0, semi);
+		}
+		while (!item.empty() && item.front() == ' ') item.remove_prefix(1);
+		while (!item.empty() && item.back() == ' ') item.remove_suffix(1);
+		if (q <= 0) continue;
+		
+		auto consider = [&](encoding e){
+			if (q > best_q || (q == best_q && e > best)) { best = e; best_q = q; }
+		};
+		if (item == "gzip" || item == "x-gzip") consider(encoding::gzip);
+		else if (item == "deflate") consider(encoding::deflate);
+#ifdef HAVE_ZSTD
+		else if (item == "zstd") consider(encoding::zstd);
+#endif
+		else if (item == "*") {
+#ifdef HAVE_ZSTD
+			consider(encoding::zstd);
+#else
+			consider(encoding::gzip);
+#endif
+		}
+	}
+	return best;
+}
+
+char const * rainboa::compress::name(encoding e) {
+	switch (e) {
+		case encoding::gzip: return "gzip";
+		case encoding::deflate: return "deflate";
+		case encoding::zstd: return "zstd";
+		default: return "identity";
+	}
+}
+
+bool rainboa::compress::apply(encoding e, asterid::buffer_assembly & body) {
+	if (e == encoding::identity || body.size() < min_size) return false;
+	compress_context & ctx = context();
+	bool ok = false;
+	switch (e) {
+		case encoding::gzip:
+			ok = apply_zlib(ctx.gzip, ctx.out, body);
+			break;
+		case encoding::deflate:
+			ok = apply_zlib(ctx.deflate, ctx.out, body);
+			break;
+#ifdef HAVE_ZSTD
+		case encoding::zstd: {
+			ctx.out.resize(ZSTD_compressBound(body.size()));
+			size_t n = ZSTD_compressCCtx(ctx.zstd, ctx.out.data(), ctx.out.size(), body.data(), body.size(), zstd_level);
+			ok = !ZSTD_isError(n);
+			if (ok) ctx.out.resize(n);
+			break;
+		}
+#endif
+		default:
+			break;
+	}
+	if (!ok || ctx.out.size() >= body.size()) return false;
+	body.resize(ctx.out.size());
+	memcpy(body.data(), ctx.out.data(), ctx.out.size());
+	if (ctx.out.capacity() > (1 << 22)) std::vector<uint8_t> {}.swap(ctx.out); // don't let one huge reply pin memory forever
+	return true;
+}
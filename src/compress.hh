@@ -0,0 +1,22 @@
+#pragma once
+#include "util.hh"
+
+// negotiated response body compression, deflate state is kept per thread and reset between responses
+namespace rainboa::compress {
+	
+	enum struct encoding {
+		identity, // ordered worst to best, negotiate() breaks q-value ties toward the later one
+		deflate,
+		gzip,
+		zstd, // only ever negotiated when built with HAVE_ZSTD
+	};
+	
+	void init();
+	
+	// picks the best encoding the client accepts from an Accept-Encoding value, identity if none
+	encoding negotiate(std::string_view accept_encoding);
+	char const * name(encoding);
+	
+	// compresses body in place, leaves it untouched and returns false if it is under the size threshold or wouldn't shrink
+	bool apply(encoding, asterid::buffer_assembly & body);
+}
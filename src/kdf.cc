@@ -0,0 +1,128 @@
+#include "kdf.hh"
+
+#include <botan/pwdhash.h>
+
+#include <deque>
+
+static std::mutex queue_m;
+static std::condition_variable queue_cv;
+static std::deque<std::function<void()>> queue;
+static std::vector<std::thread> workers;
+static size_t queue_max = 0;
+static size_t outstanding = 0, outstanding_max = SIZE_MAX; // queued plus running
+static bool run = false;
+
+static std::string scheme;
+static size_t argon_memory, argon_iterations, argon_parallelism;
+
+static void work() {
+	std::unique_lock<std::mutex> lk {queue_m};
+	while (true) {
+		queue_cv.wait(lk, [](){ return !run || !queue.empty(); });
+		if (queue.empty()) return;
+		auto job = std::move(queue.front());
+		queue.pop_front();
+		lk.unlock();
+		job();
+		lk.lock();
+		outstanding--;
+	}
+}
+
+template <typename T> static std::optional<std::future<T>> submit(std::function<T()> func) {
+	auto task = std::make_shared<std::packaged_task<T()>>(std::move(func));
+	std::future<T> f = task->get_future();
+	{
+		std::lock_guard<std::mutex> lk {queue_m};
+		if (!run || queue.size() >= queue_max || outstanding >= outstanding_max) return std::nullopt;
+		queue.emplace_back([task](){ (*task)(); });
+		outstanding++;
+	}
+	queue_cv.notify_one();
+	return f;
+}
+
+static std::string blake2b_hash(std::string const & password, int64_t salt) {
+	return rainboa::util::hex(rainboa::util::hash_blake2b(password + std::to_string(salt)));
+}
+
+static std::string argon2id_hash(std::string const & password, int64_t salt, size_t m, size_t t, size_t p) {
+	auto fam = Botan::PasswordHashFamily::create("Argon2id");
+	if (!fam) throw std::runtime_error {"Argon2id unavailable"};
+	uint8_t salt_bytes[8];
+	for (int i = 0; i < 8; i++) salt_bytes[i] = static_cast<uint64_t>(salt) >> (56 - i * 8);
+	rainboa::util::blake2b_digest out;
+	fam->from_params(m, t, p)->derive_key(out.data(), out.size(), password.data(), password.size(), salt_bytes, sizeof(salt_bytes));
+	return rainboa::util::hex(out);
+}
+
+static std::string hash_with(std::string const & scheme, std::string const & password, int64_t salt) {
+	if (scheme == "blake2b") return blake2b_hash(password, salt);
+	unsigned long m, t, p;
+	if (sscanf(scheme.c_str(), "argon2id:%lu:%lu:%lu", &m, &t, &p) == 3) return argon2id_hash(password, salt, m, t, p);
+	throw std::runtime_error {"unknown kdf scheme"};
+}
+
+static bool constant_time_equal(std::string const & a, std::string const & b) {
+	if (a.size() != b.size()) return false;
+	uint8_t diff = 0;
+	for (size_t i = 0; i < a.size(); i++) diff |= a[i] ^ b[i];
+	return !diff;
+}
+
+void rainboa::kdf::init() {
+	argon_memory = util::setting_int("KDF_MEMORY_KIB", 65536);
+	argon_iterations = util::setting_int("KDF_ITERATIONS", 3);
+	argon_parallelism = util::setting_int("KDF_PARALLELISM", 1);
+	scheme = asterid::strf("argon2id:%zu:%zu:%zu", argon_memory, argon_iterations, argon_parallelism);
+	if (!Botan::PasswordHashFamily::create("Argon2id")) {
+		scilogve << "Argon2id is not available in this build of Botan";
+		throwe(startup);
+	}
+	// Botan only rejects out of range parameters when a key is actually derived, so find out now rather than on the first claim
+	try {
+		argon2id_hash("", 0, argon_memory, argon_iterations, argon_parallelism);
+	} catch (std::exception const & e) {
+		scilogve << "invalid KDF parameters (" << scheme << "): " << e.what();
+		throwe(startup);
+	}
+	
+	size_t threads = util::setting_int("KDF_THREADS", std::max(std::thread::hardware_concurrency() / 2, 1u));
+	queue_max = util::setting_int("KDF_QUEUE", threads * 4);
+	run = true;
+	for (size_t i = 0; i < threads; i++) workers.emplace_back(work);
+}
+
+void rainboa::kdf::limit_outstanding(size_t max) {
+	std::lock_guard<std::mutex> lk {queue_m};
+	outstanding_max = max;
+}
+
+void rainboa::kdf::term() noexcept {
+	{
+		std::lock_guard<std::mutex> lk {queue_m};
+		run = false;
+	}
+	queue_cv.notify_all();
+	for (auto & w : workers) w.join();
+	workers.clear();
+}
+
+std::string const & rainboa::kdf::current_scheme() {
+	return scheme;
+}
+
+std::optional<std::future<std::string>> rainboa::kdf::derive(std::string password, int64_t salt) {
+	return submit<std::string>([password = std::move(password), salt](){
+		return hash_with(scheme, password, salt);
+	});
+}
+
+std::optional<std::future<bool>> rainboa::kdf::verify(std::string password, int64_t salt, std::string scheme, std::string hash) {
+	return submit<bool>([password = std::move(password), salt, scheme = std::move(scheme), hash = std::move(hash)](){
+		// CHAR(128) comes back blank padded if a scheme ever produces a shorter hash
+		std::string_view stored = hash;
+		while (!stored.empty() && stored.back() == ' ') stored.remove_suffix(1);
+		return constant_time_equal(hash_with(scheme, password, salt), std::string {stored});
+	});
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "util.hh"
+
+#include <future>
+#include <optional>
+
+// password derivation and verification, run on a dedicated fixed-size pool so slow hashing never ties up server workers
+namespace rainboa::kdf {
+	
+	void init();
+	void term() noexcept;
+	
+	// the scheme string stored alongside a hash, e.g. "argon2id:65536:3:1", or "blake2b" for legacy hashes
+	std::string const & current_scheme();
+	
+	// caps queued plus running jobs, callers wait on them holding an admission slot, so this has to stay below the admission limit
+	void limit_outstanding(size_t max);
+	
+	// both return nullopt immediately if the queue is full, the caller should fail the request rather than wait
+	std::optional<std::future<std::string>> derive(std::string password, int64_t salt);
+	std::optional<std::future<bool>> verify(std::string password, int64_t salt, std::string scheme, std::string hash);
+}
@@ -1,9 +1,135 @@
+#include "admission.hh"
 #include "api.hh"
+#include "compress.hh"
+#include "kdf.hh"
+#include "metrics.hh"
+
+#include <cstring>
+
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 namespace aeon = asterid::aeon;
+namespace metrics = rainboa::metrics;
+
+static metrics::metric_id const parse_metric = metrics::histogram("rainboa_parse_seconds", "", "request body parse time");
+static metrics::metric_id const serialize_metric = metrics::histogram("rainboa_serialize_seconds", "", "response body serialization time");
+
+// request limits, set from RAINBOA_MAX_BODY, RAINBOA_MAX_AEON_BODY, RAINBOA_MAX_DEPTH and RAINBOA_MAX_CMDS in run_worker()
+static size_t max_body = 1 << 20;
+// aeon's binary parser recurses without a depth limit and can't be scanned ahead of time like JSON
+// every nesting level costs at least one byte, so keeping binary bodies small is what bounds that recursion
+static size_t max_aeon_body = 8 << 10;
+static size_t max_depth = 16;
+static size_t max_cmds = 256;
+
+// cheap pass over raw JSON that measures nesting depth and top level element count without building anything
+// returns false as soon as either limit is exceeded, malformed input is left for the real parser to reject
+static bool json_within_limits(std::string_view text) {
+	size_t depth = 0, elements = 0;
+	bool in_string = false, escaped = false, pending_element = false;
+	for (char c : text) {
+		if (in_string) {
+			if (escaped) escaped = false;
+			else if (c == '\\') escaped = true;
+			else if (c == '"') in_string = false;
+			continue;
+		}
+		switch (c) {
+			case '"':
+				in_string = true;
+				[[fallthrough]];
+			default:
+				if (depth == 1 && !pending_element && c != ' ' && c != '\t' && c != '\r' && c != '\n' && c != ']') {
+					pending_element = true;
+					if (++elements > max_cmds) return false;
+				}
+				break;
+			case '[':
+			case '{':
+				if (depth == 1 && !pending_element) {
+					pending_element = true;
+					if (++elements > max_cmds) return false;
+				}
+				if (++depth > max_depth) return false;
+				break;
+			case ']':
+			case '}':
+				if (depth) depth--;
+				break;
+			case ',':
+				if (depth == 1) pending_element = false;
+				break;
+		}
+	}
+	return true;
+}
+
+// the same depth bound for parsed binary bodies, which max_aeon_body has already kept small enough to parse safely
+// counted like the JSON scan: the top level array is depth 1, scalars don't add a level
+static bool aeon_within_depth(aeon::object const & obj, size_t depth = 1) {
+	if (!obj.is_array() && !obj.is_map()) return true;
+	if (depth > max_depth) return false;
+	if (obj.is_array()) {
+		for (aeon::object const & child : obj.array()) if (!aeon_within_depth(child, depth + 1)) return false;
+	} else {
+		for (auto const & [key, child] : obj.map()) if (!aeon_within_depth(child, depth + 1)) return false;
+	}
+	return true;
+}
+
+// compresses a finished body if the client accepts an encoding and it's worth the trouble
+static void encode_body(locust::basic_exchange_interface & bei) {
+	bei.res_head.fields["Vary"] = "Accept-Encoding";
+	rainboa::compress::encoding enc = rainboa::compress::negotiate(bei.req_head.field("Accept-Encoding"));
+	if (rainboa::compress::apply(enc, bei.res_body)) bei.res_head.fields["Content-Encoding"] = rainboa::compress::name(enc);
+}
+
+// set from RAINBOA_TRUSTED_PROXY in run_worker(), only then are the forwarding headers believed
+static bool trusted_proxy = false;
+
+// locust doesn't hand us the peer address, so clients can only be told apart by what a fronting proxy reports
+// without a trusted proxy anyone could pick their own identity, so per-client limits don't apply at all
+static std::string client_of(locust::basic_exchange_interface & bei) {
+	if (!trusted_proxy) return {};
+	std::string ip = bei.req_head.field("X-Real-IP");
+	if (!ip.empty()) return ip;
+	// the proxy appends the address it saw, anything before that came from the client
+	ip = bei.req_head.field("X-Forwarded-For");
+	size_t comma = ip.rfind(',');
+	if (comma != std::string::npos) ip.erase(0, comma + 1);
+	size_t start = ip.find_first_not_of(' ');
+	return start == std::string::npos ? std::string {} : ip.substr(start);
+}
+
+// counts the response status on the way out of respond(), whichever return it takes
+struct status_counter {
+	locust::basic_exchange_interface & bei;
+	~status_counter() {
+		static std::atomic<metrics::metric_id> ids[600] {}; // id + 1, 0 until first seen
+		unsigned code = static_cast<unsigned>(bei.res_head.code);
+		if (code >= 600) return;
+		metrics::metric_id id = ids[code].load(std::memory_order_relaxed);
+		if (!id) {
+			id = metrics::counter("rainboa_http_responses_total", "code=\"" + std::to_string(code) + "\"", "HTTP responses by status code") + 1;
+			ids[code].store(id, std::memory_order_relaxed);
+		}
+		metrics::inc(id - 1);
+	}
+};
 
 struct rainboa_exchange : public locust::basic_responder {
 	virtual void respond(locust::basic_exchange_interface & bei) override {
+		status_counter sc {bei};
+		
+		if (bei.req_head.method == "GET" && bei.req_head.path == "/metrics") {
+			bei.res_head.code = locust::http::status_code::ok;
+			bei.res_head.fields["Content-Type"] = "text/plain; version=0.0.4";
+			bei.res_body << metrics::expose();
+			encode_body(bei);
+			return;
+		}
 		
 		if (bei.req_head.method == "OPTIONS") {
 			bei.res_head.code = locust::http::status_code::ok;
@@ -38,16 +164,46 @@ struct rainboa_exchange : public locust::basic_responder {
 			return;
 		}
 		
+		auto too_large = [&](){
+			bei.res_head.code = locust::http::status_code::payload_too_large;
+			bei.res_head.fields["Content-Type"] = "text/plain; charset=UTF-8";
+			bei.res_body << u8"That's way too much, I'm not eating all of that. 🐍";
+		};
+		
+		size_t limit = bei.req_head.content_type() == "application/aeon" ? std::min(max_body, max_aeon_body) : max_body;
+		if (bei.req_head.content_length() > limit || bei.req_body.size() > limit) {
+			too_large();
+			return;
+		}
+		
+		rainboa::admission::ticket ticket = rainboa::admission::admit(client_of(bei));
+		if (!ticket) {
+			bei.res_head.code = locust::http::status_code::service_unavailable;
+			bei.res_head.fields["Retry-After"] = std::to_string(ticket.retry_after);
+			bei.res_head.fields["Content-Type"] = "text/plain; charset=UTF-8";
+			bei.res_body << u8"I'm stuffed, come back later. 🐍";
+			return;
+		}
+		
 		aeon::object rec {};
 		bool return_aeon = false;
 		
 		try {
+			metrics::timer t {parse_metric};
 			if (bei.req_head.content_type() == "application/aeon") {
-				asterid::buffer_assembly body {bei.req_body};
-				rec = aeon::object::parse_binary(body);
+				rec = aeon::object::parse_binary(bei.req_body); // consumes the body in place
 				return_aeon = true;
+				if (!aeon_within_depth(rec)) {
+					too_large();
+					return;
+				}
 			} else {
-				rec = aeon::object::parse_text(bei.req_body.to_string());
+				std::string_view text {reinterpret_cast<char const *>(bei.req_body.data()), bei.req_body.size()};
+				if (!json_within_limits(text)) {
+					too_large();
+					return;
+				}
+				rec = aeon::object::parse_text(text);
 			}
 		} catch (aeon::exception::parse &) {
 			bei.res_head.code = locust::http::status_code::bad_request;
@@ -56,16 +212,46 @@ struct rainboa_exchange : public locust::basic_responder {
 			return;
 		}
 		
-		aeon::object ret = rainboa::api::process(rec);
+		if (!rec.is_array()) {
+			bei.res_head.code = locust::http::status_code::bad_request;
+			bei.res_head.fields["Content-Type"] = "text/plain; charset=UTF-8";
+			bei.res_body << u8"I wanted a list of things to do, not whatever this is. 🐍";
+			return;
+		}
+		
+		// binary bodies can only be measured once parsed, but this still happens before anything executes
+		if (rec.array().size() > max_cmds) {
+			too_large();
+			return;
+		}
 		
 		bei.res_head.code = locust::http::status_code::ok;
+		rainboa::api::deadline_t deadline = rainboa::api::deadline_for(bei.req_head.field("X-Request-Timeout"));
+		
 		if (return_aeon) {
+			// the binary array header carries its element count up front, so aeon replies are still built whole
+			aeon::object ret = rainboa::api::process(rec, deadline);
 			bei.res_head.fields["Content-Type"] = "application/aeon";
-			ret.serialize_binary(bei.res_body);
-		} else {
-			bei.res_head.fields["Content-Type"] = "application/json";
-			bei.res_body << ret.serialize_text();
+			{
+				metrics::timer t {serialize_metric};
+				ret.serialize_binary(bei.res_body);
+			}
+			encode_body(bei);
+			return;
 		}
+		
+		// JSON is written element by element as results complete, only one command's result is ever serialized at a time
+		bei.res_head.fields["Content-Type"] = "application/json";
+		bei.res_body << "[";
+		bool first = true;
+		rainboa::api::process(rec, deadline, [&](aeon::object && obj){
+			metrics::timer t {serialize_metric};
+			if (!first) bei.res_body << ",";
+			first = false;
+			bei.res_body << obj.serialize_text();
+		});
+		bei.res_body << "]";
+		encode_body(bei);
 	}
 };
 
@@ -75,25 +261,85 @@ static void handle_signal(int sig) {
 	switch (sig) {
 		default:
 			return;
+		case SIGTERM: // from a service manager or the supervisor, never escalates
+			run_sem.store(false);
+			return;
 		case SIGINT:
 			if (run_sem) run_sem.store(false);
 			else std::terminate();
 	}
 }
 
-int main() {	
-	signal(SIGINT, handle_signal);
+static int run_worker() {
 	rainboa::util::init();
+	max_body = rainboa::util::setting_int("MAX_BODY", max_body);
+	max_aeon_body = rainboa::util::setting_int("MAX_AEON_BODY", max_aeon_body);
+	max_depth = rainboa::util::setting_int("MAX_DEPTH", max_depth);
+	max_cmds = rainboa::util::setting_int("MAX_CMDS", max_cmds);
+	trusted_proxy = rainboa::util::setting_int("TRUSTED_PROXY", 0);
+	if (!trusted_proxy && rainboa::util::setting_int("CLIENT_RATE", 0) > 0) scilogw << "RAINBOA_CLIENT_RATE has no effect without RAINBOA_TRUSTED_PROXY, clients can't be identified";
+	rainboa::compress::init();
+	int ret = 0;
 	try {
 		rainboa::api::init();
-		asterid::cicada::server sv {8081, false, NUM_CON};
+		unsigned threads = rainboa::util::server_threads();
+		rainboa::admission::init(std::min<size_t>(rainboa::api::capacity(), threads), threads);
+		// logins hold their admission slot while they wait on password hashing, leave at least half the slots to everything else
+		rainboa::kdf::limit_outstanding(std::max<size_t>(rainboa::admission::concurrency() / 2, 1));
+		asterid::cicada::server sv {8081, false, threads};
 		sv.begin<locust::http::protocol<locust::basic_exchange<rainboa_exchange>>>();
 		sv.master( [](){return run_sem.load();} );
 	} catche(startup) {
 		scilogvf << "startup exception occurred, cannot continue";
+		ret = 1;
 	} catchall {
 		scilogvf << "unknown exception occurred, cannot continue";
+		ret = 1;
 	}
 	rainboa::api::term();
 	rainboa::util::term();
+	return ret;
+}
+
+// keeps one worker process running and restarts it if it dies, so a crash costs the requests in flight rather than the service
+// only one worker: cicada::server binds without SO_REUSEPORT, so a second process couldn't share the port
+// the supervisor stays single threaded so it can keep forking safely, which is also why it writes to stderr instead of the logger
+static int supervise() {
+	while (run_sem) {
+		std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+		pid_t pid = fork();
+		if (pid == 0) {
+			prctl(PR_SET_PDEATHSIG, SIGTERM); // don't outlive a killed supervisor
+			if (getppid() == 1) _exit(0);
+			exit(run_worker());
+		}
+		if (pid < 0) {
+			fprintf(stderr, "supervisor: fork failed: %s\n", strerror(errno));
+			sleep(1);
+			continue;
+		}
+		
+		int status;
+		if (!run_sem) kill(pid, SIGTERM); // stopped while forking
+		while (waitpid(pid, &status, 0) < 0) { // SIGINT interrupts this, the handler is installed without SA_RESTART
+			if (errno != EINTR) return 1;
+			if (!run_sem) kill(pid, SIGTERM);
+		}
+		if (!run_sem) break;
+		if (WIFSIGNALED(status)) fprintf(stderr, "supervisor: worker %d killed by signal %d, restarting\n", pid, WTERMSIG(status));
+		else fprintf(stderr, "supervisor: worker %d exited with status %d, restarting\n", pid, WEXITSTATUS(status));
+		if (std::chrono::steady_clock::now() - started < std::chrono::seconds {1}) sleep(1); // crash looping, don't spin
+	}
+	fprintf(stderr, "supervisor: worker stopped\n");
+	return 0;
+}
+
+int main() {
+	struct sigaction sa {};
+	sa.sa_handler = handle_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+	if (rainboa::util::setting_int("SUPERVISE", 0)) return supervise();
+	return run_worker();
 }
@@ -0,0 +1,150 @@
+#include "metrics.hh"
+
+#include <map>
+
+using namespace rainboa::metrics;
+
+static constexpr size_t max_counters = 512;
+static constexpr size_t max_histograms = 128;
+
+// upper bounds in seconds, the last bucket is +Inf
+static constexpr double bucket_bounds[] = {0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+static constexpr size_t num_buckets = sizeof(bucket_bounds) / sizeof(double) + 1;
+
+namespace {
+	
+	// written only by the owning thread, read by whoever exports
+	struct thread_block {
+		std::atomic<uint64_t> counters[max_counters] {};
+		struct hist {
+			std::atomic<uint64_t> buckets[num_buckets] {};
+			std::atomic<uint64_t> count {0};
+			std::atomic<uint64_t> sum_ns {0};
+		} histograms[max_histograms];
+	};
+	
+	struct metric_desc {
+		std::string name;
+		std::string labels;
+	};
+	
+	struct family {
+		std::string help;
+		bool is_histogram;
+	};
+}
+
+// function local so that statics in other translation units can register during their own initialization
+struct registry {
+	std::mutex m;
+	std::vector<metric_desc> counters;
+	std::vector<metric_desc> histograms;
+	std::map<std::string, family> families;
+	std::vector<std::function<void(std::string &)>> collectors;
+	std::vector<thread_block *> blocks; // never freed, a thread that exits leaves its totals behind for export
+};
+
+static registry & reg() {
+	static registry r;
+	return r;
+}
+
+static thread_block & local() {
+	static thread_local thread_block * block = [](){
+		thread_block * b = new thread_block;
+		std::lock_guard<std::mutex> lk {reg().m};
+		reg().blocks.push_back(b);
+		return b;
+	}();
+	return *block;
+}
+
+static metric_id do_register(std::vector<metric_desc> & descs, size_t max, bool is_histogram, std::string const & name, std::string const & labels, std::string const & help) {
+	std::lock_guard<std::mutex> lk {reg().m};
+	for (size_t i = 0; i < descs.size(); i++) {
+		if (descs[i].name == name && descs[i].labels == labels) return i;
+	}
+	if (descs.size() == max) {
+		scilogve << "metric registry full, dropping " << name;
+		return max; // inc/observe ignore out of range ids
+	}
+	reg().families.emplace(name, family {help, is_histogram});
+	descs.push_back({name, labels});
+	return descs.size() - 1;
+}
+
+metric_id rainboa::metrics::counter(std::string const & name, std::string const & labels, std::string const & help) {
+	return do_register(reg().counters, max_counters, false, name, labels, help);
+}
+
+metric_id rainboa::metrics::histogram(std::string const & name, std::string const & labels, std::string const & help) {
+	return do_register(reg().histograms, max_histograms, true, name, labels, help);
+}
+
+void rainboa::metrics::inc(metric_id id, uint64_t n) {
+	if (id >= max_counters) return;
+	auto & c = local().counters[id];
+	c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void rainboa::metrics::observe(metric_id id, clock::duration d) {
+	if (id >= max_histograms) return;
+	auto & h = local().histograms[id];
+	uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+	double s = ns / 1e9;
+	size_t b = 0;
+	while (b < num_buckets - 1 && s > bucket_bounds[b]) b++;
+	h.buckets[b].store(h.buckets[b].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	h.count.store(h.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	h.sum_ns.store(h.sum_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+}
+
+void rainboa::metrics::add_collector(std::function<void(std::string &)> func) {
+	std::lock_guard<std::mutex> lk {reg().m};
+	reg().collectors.push_back(std::move(func));
+}
+
+static std::string series(std::string const & name, std::string const & labels, std::string const & extra = "") {
+	std::string l = labels;
+	if (!extra.empty()) l += (l.empty() ? "" : ",") + extra;
+	return l.empty() ? name : name + "{" + l + "}";
+}
+
+std::string rainboa::metrics::expose() {
+	registry & r = reg();
+	std::lock_guard<std::mutex> lk {r.m};
+	std::string out;
+	for (auto const & [name, fam] : r.families) {
+		out += "# HELP " + name + " " + fam.help + "\n";
+		out += "# TYPE " + name + (fam.is_histogram ? " histogram\n" : " counter\n");
+		if (!fam.is_histogram) {
+			for (size_t i = 0; i < r.counters.size(); i++) {
+				if (r.counters[i].name != name) continue;
+				uint64_t v = 0;
+				for (thread_block * b : r.blocks) v += b->counters[i].load(std::memory_order_relaxed);
+				out += series(name, r.counters[i].labels) + " " + std::to_string(v) + "\n";
+			}
+			continue;
+		}
+		for (size_t i = 0; i < r.histograms.size(); i++) {
+			if (r.histograms[i].name != name) continue;
+			uint64_t buckets[num_buckets] {}, count = 0, sum_ns = 0;
+			for (thread_block * b : r.blocks) {
+				auto & h = b->histograms[i];
+				for (size_t j = 0; j < num_buckets; j++) buckets[j] += h.buckets[j].load(std::memory_order_relaxed);
+				count += h.count.load(std::memory_order_relaxed);
+				sum_ns += h.sum_ns.load(std::memory_order_relaxed);
+			}
+			uint64_t cumulative = 0;
+			for (size_t j = 0; j < num_buckets; j++) {
+				cumulative += buckets[j];
+				std::string le = j < num_buckets - 1 ? asterid::strf("le=\"%g\"", bucket_bounds[j]) : "le=\"+Inf\"";
+				out += series(name + "_bucket", r.histograms[i].labels, le) + " " + std::to_string(cumulative) + "\n";
+			}
+			out += series(name + "_sum", r.histograms[i].labels) + " " + asterid::strf("%.9f", sum_ns / 1e9) + "\n";
+			out += series(name + "_count", r.histograms[i].labels) + " " + std::to_string(count) + "\n";
+		}
+	}
+	for (auto const & c : r.collectors) c(out);
+	return out;
+}
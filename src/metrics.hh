@@ -0,0 +1,29 @@
+#pragma once
+#include "util.hh"
+
+// counters and latency histograms, aggregated per thread and summed on export
+namespace rainboa::metrics {
+	
+	typedef size_t metric_id;
+	typedef std::chrono::steady_clock clock;
+	
+	// registration is thread-safe and idempotent for the same name and labels, cache the id rather than registering on a hot path
+	// labels are in exposition form without the braces, e.g. R"(cmd="acct_token")"
+	metric_id counter(std::string const & name, std::string const & labels, std::string const & help);
+	metric_id histogram(std::string const & name, std::string const & labels, std::string const & help);
+	
+	void inc(metric_id, uint64_t n = 1);
+	void observe(metric_id, clock::duration);
+	
+	// extra text appended to every export, for values owned elsewhere (pool sizes and such)
+	void add_collector(std::function<void(std::string &)>);
+	
+	std::string expose(); // Prometheus text exposition format
+	
+	struct timer {
+		inline timer(metric_id id) : id(id), start(clock::now()) {}
+		inline ~timer() { observe(id, clock::now() - start); }
+		metric_id id;
+		clock::time_point start;
+	};
+}
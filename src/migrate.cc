@@ -0,0 +1,86 @@
+#include "migrate.hh"
+
+#include <cstring>
+#include <map>
+
+using namespace rainboa;
+
+static std::string checksum(migrate::migration const & m) {
+	return util::hex(util::hash_blake2b(m.sql));
+}
+
+// version -> checksum of what's already applied, false if the table doesn't exist yet
+static bool applied_versions(postgres::pool::conview & dbv, std::string const & component, std::map<int, std::string> & applied) {
+	postgres::result res = dbv.exec_params("SELECT version, checksum FROM public.schema_version WHERE component = $1::TEXT", component);
+	if (!res.tuples_ok()) {
+		if (res.get_sqlstate() == "42P01") return false; // undefined_table, a fresh database
+		scilogve << res.get_error();
+		throwe(startup);
+	}
+	applied.clear();
+	for (auto [version, sum] : res.rows<postgres::int_t, std::string>()) applied[version] = std::move(sum);
+	return true;
+}
+
+// true if everything is applied, throws on a checksum mismatch
+static bool up_to_date(std::string const & component, std::vector<migrate::migration> const & migrations, std::map<int, std::string> const & applied) {
+	bool ret = true;
+	for (migrate::migration const & m : migrations) {
+		auto i = applied.find(m.version);
+		if (i == applied.end()) { ret = false; continue; }
+		if (i->second != checksum(m)) {
+			scilogve << asterid::strf("%s migration %d (%s) was changed after being applied", component.c_str(), m.version, m.name);
+			throwe(startup);
+		}
+	}
+	return ret;
+}
+
+void migrate::apply(postgres::pool::conview & dbv, std::string const & component, std::vector<migration> const & migrations) {
+	std::map<int, std::string> applied;
+	if (applied_versions(dbv, component, applied) && up_to_date(component, migrations, applied)) return;
+	
+	// other instances starting alongside this one wait here, then find the work already done
+	util::blake2b_digest digest = util::hash_blake2b("rainboa_migrate:" + component);
+	int64_t lock_key;
+	memcpy(&lock_key, digest.data(), sizeof(lock_key));
+	if (!dbv.exec_params("SELECT pg_advisory_lock($1::BIGINT)", lock_key).tuples_ok()) throwe(startup);
+	auto unlock = [&](){ dbv.exec_params("SELECT pg_advisory_unlock($1::BIGINT)", lock_key); };
+	
+	if (!dbv.cmd(R"(
+		CREATE TABLE IF NOT EXISTS public.schema_version (
+			component TEXT NOT NULL,
+			version INT NOT NULL,
+			name TEXT NOT NULL,
+			checksum TEXT NOT NULL,
+			applied_at TIMESTAMP NOT NULL DEFAULT NOW(),
+			PRIMARY KEY (component, version)
+		)
+	)")) { unlock(); throwe(startup); }
+	
+	try {
+		applied_versions(dbv, component, applied);
+		up_to_date(component, migrations, applied);
+	} catche(startup) {
+		unlock();
+		throw;
+	}
+	
+	for (migration const & m : migrations) {
+		if (applied.count(m.version)) continue;
+		scilogi << asterid::strf("applying %s migration %d: %s", component.c_str(), m.version, m.name);
+		dbv.begin();
+		if (!dbv.cmd(m.sql) || !dbv.cmd_params("INSERT INTO public.schema_version (component, version, name, checksum) VALUES ($1::TEXT, $2::INT, $3::TEXT, $4::TEXT)", component, static_cast<int32_t>(m.version), m.name, checksum(m))) {
+			dbv.rollback();
+			unlock();
+			scilogve << asterid::strf("%s migration %d (%s) failed", component.c_str(), m.version, m.name);
+			throwe(startup);
+		}
+		if (!dbv.commit()) {
+			unlock();
+			scilogve << asterid::strf("%s migration %d (%s) failed to commit", component.c_str(), m.version, m.name);
+			throwe(startup);
+		}
+	}
+	unlock();
+}
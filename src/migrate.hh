@@ -0,0 +1,16 @@
+#pragma once
+#include "psql.hh"
+
+// versioned schema migrations, each component's history is recorded in public.schema_version
+// startup costs a single SELECT when nothing is pending, migrations only ever run under an advisory lock
+namespace rainboa::migrate {
+	
+	struct migration {
+		int version; // ascending from 1, never reuse or edit an applied one, append a new one instead
+		char const * name;
+		char const * sql; // may hold several statements, all run in one transaction with the version bump
+	};
+	
+	// throws exception::startup if a migration fails or an applied one no longer matches its checksum
+	void apply(postgres::pool::conview & dbv, std::string const & component, std::vector<migration> const & migrations);
+}
@@ -2,8 +2,21 @@
 
 #include <libpq-fe.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <unordered_set>
+
+#include <poll.h>
+
 static void notice (void *, char const *) {}
 
+static rainboa::metrics::metric_id const pipeline_metric = rainboa::metrics::histogram("rainboa_sql_seconds", "statement=\"(pipeline)\"", "SQL execution time per statement, pipelined batches are timed as a whole");
+static rainboa::metrics::metric_id const pool_wait_metric = rainboa::metrics::histogram("rainboa_pool_wait_seconds", "", "time spent acquiring a pooled connection");
+
+postgres::statement::statement(std::string const & name, std::string const & sql, result_format format, access mode) : name(name), sql(sql), format(format), mode(mode),
+	metric(rainboa::metrics::histogram("rainboa_sql_seconds", "statement=\"" + name + "\"", "SQL execution time per statement, pipelined batches are timed as a whole")) {}
+
 struct postgres::result::private_data {
 	PGresult * res = nullptr;
 	ExecStatusType status = PGRES_BAD_RESPONSE;
@@ -21,10 +34,33 @@ postgres::result::~result() {}
 int postgres::result::num_fields() const { return PQnfields(data->res); }
 int postgres::result::num_rows() const { return PQntuples(data->res); }
 postgres::value postgres::result::get_value(int row, int field) const { char * c = PQgetvalue(data->res, row, field); return c ? c : ""; }
+std::string_view postgres::result::get_view(int row, int field) const {
+	char * c = PQgetvalue(data->res, row, field);
+	return c ? std::string_view {c, static_cast<size_t>(PQgetlength(data->res, row, field))} : std::string_view {};
+}
+bool postgres::result::is_null(int row, int field) const { return PQgetisnull(data->res, row, field); }
+bool postgres::result::is_binary(int field) const { return PQfformat(data->res, field) == 1; }
 std::string postgres::result::get_error() const { return PQresultErrorMessage(data->res); }
+std::string postgres::result::get_sqlstate() const { char * c = data->res ? PQresultErrorField(data->res, PG_DIAG_SQLSTATE) : nullptr; return c ? c : ""; }
+std::string postgres::result::get_constraint() const { char * c = data->res ? PQresultErrorField(data->res, PG_DIAG_CONSTRAINT_NAME) : nullptr; return c ? c : ""; }
 bool postgres::result::cmd_ok() const { return data->status == PGRES_COMMAND_OK; }
 bool postgres::result::tuples_ok() const { return data->status == PGRES_TUPLES_OK; }
 
+postgres::timestamp_t postgres::decode_internal::decode_timestamp(std::string_view raw, bool binary) {
+	// postgres counts microseconds from 2000-01-01 UTC
+	static constexpr std::chrono::seconds pg_epoch {946684800};
+	if (binary) return timestamp_t {pg_epoch + std::chrono::duration_cast<timestamp_t::duration>(std::chrono::microseconds {decode_int<bigint_t>(raw, true)})};
+	std::string str {raw};
+	tm t {};
+	double sec = 0;
+	if (sscanf(str.c_str(), "%d-%d-%d %d:%d:%lf", &t.tm_year, &t.tm_mon, &t.tm_mday, &t.tm_hour, &t.tm_min, &sec) != 6) return {};
+	t.tm_year -= 1900;
+	t.tm_mon -= 1;
+	t.tm_sec = static_cast<int>(sec);
+	auto frac = std::chrono::duration_cast<timestamp_t::duration>(std::chrono::duration<double> {sec - t.tm_sec});
+	return std::chrono::system_clock::from_time_t(timegm(&t)) + frac;
+}
+
 postgres::result & postgres::result::operator = (result && other) {
 	data = std::move(other.data);
 	return *this;
@@ -33,14 +69,58 @@ postgres::result & postgres::result::operator = (result && other) {
 struct postgres::connection::private_data {
 	PGconn * con = nullptr;
 	bool ok = false;
+	std::unordered_set<std::string> prepared;
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
 	~private_data() { if (con) PQfinish(con); }
+	
+	void cancel() {
+		PGcancel * c = PQgetCancel(con);
+		if (!c) return;
+		char err[256];
+		if (!PQcancel(c, err, sizeof(err))) scilogvw << "failed to cancel statement: " << std::string {err};
+		PQfreeCancel(c);
+	}
+	
+	// waits until a result can be read without blocking, cancelling whatever is running once the deadline passes
+	// the cancel is repeated while results trickle in, so later statements of a pipeline don't run on past the deadline either
+	bool await() {
+		static constexpr std::chrono::milliseconds recancel {50};
+		auto next_cancel = deadline;
+		while (true) {
+			if (!PQconsumeInput(con)) return false;
+			if (!PQisBusy(con)) return true;
+			auto now = std::chrono::steady_clock::now();
+			if (now >= next_cancel) {
+				cancel();
+				next_cancel = now + recancel;
+			}
+			int timeout = next_cancel == std::chrono::steady_clock::time_point::max() ? -1 :
+				std::chrono::ceil<std::chrono::milliseconds>(next_cancel - now).count();
+			pollfd pfd {PQsocket(con), POLLIN, 0};
+			if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) return false;
+		}
+	}
+	
+	// the asynchronous equivalent of the PQexec family's return value: the first error, otherwise the last result
+	PGresult * finish() {
+		PGresult * ret = nullptr;
+		while (await()) {
+			PGresult * res = PQgetResult(con);
+			if (!res) break;
+			if (!ret) ret = res;
+			else if (PQresultStatus(ret) == PGRES_FATAL_ERROR) PQclear(res);
+			else { PQclear(ret); ret = res; }
+		}
+		return ret;
+	}
 };
 
-postgres::connection::connection(std::string const & dbname) : data { new private_data } {
-	std::string constr = "user=postgres dbname=" + dbname;
+postgres::connection::connection(std::string const & conninfo) : data { new private_data } {
+	std::string constr = conninfo.find('=') == std::string::npos ? "user=postgres dbname=" + conninfo : conninfo;
 	data->con = PQconnectdb(constr.c_str());
 	if (PQstatus(data->con) != CONNECTION_OK) {
-		scilogve << asterid::strf("failed to connect to database \"%s\" (status %i)", dbname.c_str(), PQstatus(data->con));
+		// not the connection string itself, it may carry a password
+		scilogve << asterid::strf("failed to connect to database \"%s\" (status %i)", PQdb(data->con), PQstatus(data->con));
 		return;
 	}
 	PQsetNoticeProcessor(data->con, notice, nullptr);
@@ -48,43 +128,348 @@ postgres::connection::connection(std::string const & dbname) : data { new privat
 }
 postgres::connection::~connection() {}
 
-postgres::result postgres::connection::exec(std::string const & cmd) { return PQexec(data->con, cmd.c_str()); }
-postgres::result postgres::connection::exec_params(std::string const & cmd, std::initializer_list<std::string_view> params) {
-	char const * * ptrs = new char const * [params.size()];
-	size_t i = 0;
-	for (std::string_view const & str : params) {
-		ptrs[i++] = str.data();
+// everything goes through the asynchronous API so that a deadline can interrupt the wait
+postgres::result postgres::connection::exec(std::string const & cmd) {
+	if (!PQsendQuery(data->con, cmd.c_str())) return nullptr;
+	return data->finish();
+}
+postgres::result postgres::connection::exec_params(std::string const & cmd, bind_internal::param_view params) {
+	if (!PQsendQueryParams(data->con, cmd.c_str(), params.n, params.types, params.values, params.lengths, params.formats, 0)) return nullptr;
+	return data->finish();
+}
+
+bool postgres::connection::wait_notifications(std::chrono::milliseconds timeout, std::function<void(std::string_view, std::string_view)> const & on_notify) {
+	pollfd pfd {PQsocket(data->con), POLLIN, 0};
+	if (pfd.fd < 0 || (poll(&pfd, 1, timeout.count()) < 0 && errno != EINTR) || !PQconsumeInput(data->con)) {
+		data->ok = false;
+		return false;
+	}
+	while (PGnotify * n = PQnotifies(data->con)) {
+		on_notify(n->relname, n->extra);
+		PQfreemem(n);
 	}
-	auto result = PQexecParams(data->con, cmd.c_str(), params.size(), nullptr, ptrs, nullptr, nullptr, 0);
-	delete [] ptrs;
-	return result;
+	return true;
+}
+
+void postgres::connection::set_deadline(std::chrono::steady_clock::time_point tp) { data->deadline = tp; }
+
+postgres::result postgres::connection::exec_prepared(statement const & stmt, bind_internal::param_view params) {
+	rainboa::metrics::timer t {stmt.metric};
+	if (PQstatus(data->con) != CONNECTION_OK && !reset()) return nullptr;
+	result res;
+	for (int attempt = 0; attempt < 2; attempt++) {
+		if (!data->prepared.count(stmt.name)) {
+			res = PQsendPrepare(data->con, stmt.name.c_str(), stmt.sql.c_str(), params.n, params.types) ? data->finish() : nullptr;
+			if (!res.cmd_ok()) break;
+			data->prepared.insert(stmt.name);
+		}
+		res = PQsendQueryPrepared(data->con, stmt.name.c_str(), params.n, params.values, params.lengths, params.formats, static_cast<int>(stmt.format)) ? data->finish() : nullptr;
+		// the server dropped it out from under us (DISCARD ALL, pooler reassignment), the statement never ran so it is safe to prepare and try again
+		if (res.get_sqlstate() != "26000") break;
+		data->prepared.erase(stmt.name);
+	}
+	return res;
 }
 
 bool postgres::connection::ok() { return data->ok; }
 
-postgres::pool::pool(std::string const & dbname, unsigned int num_cons) {
-	for (unsigned int i = 0; i < num_cons; i++) {
-		cons.emplace_back(new pool_con {dbname, cvm, cv});
+struct postgres::pipeline::private_data {
+	enum struct entry_type : uint8_t {
+		prepare,
+		query,
+		sync,
+	};
+	struct entry {
+		entry_type type;
+		size_t idx; // result index for queries
+		std::string name; // statement name for prepares
+	};
+	connection & con;
+	std::vector<entry> entries;
+	std::vector<result> results;
+	bool active = false;
+	bool dirty = false; // statements sent since the last sync
+	bool wrote = false;
+	private_data(connection & con) : con(con) {}
+	PGconn * pgcon() { return con.data->con; }
+	void sync() {
+		if (!dirty) return;
+		PQpipelineSync(pgcon());
+		entries.push_back({entry_type::sync, 0, {}});
+		dirty = false;
+	}
+};
+
+postgres::pipeline::pipeline(connection & con) : data { new private_data {con} } {}
+postgres::pipeline::~pipeline() { collect(); }
+
+size_t postgres::pipeline::queue(statement const & stmt, bind_internal::param_view params) {
+	size_t idx = data->results.size();
+	data->results.emplace_back();
+	PGconn * pc = data->pgcon();
+	if (!data->active) {
+		if (PQstatus(pc) != CONNECTION_OK && !data->con.reset()) return idx;
+		pc = data->pgcon();
+		if (!PQenterPipelineMode(pc)) return idx;
+		data->active = true;
+	}
+	if (!data->con.data->prepared.count(stmt.name)) {
+		bool pending = false;
+		for (auto const & e : data->entries) if (e.type == private_data::entry_type::prepare && e.name == stmt.name) pending = true;
+		if (!pending) {
+			// isolated in its own sync segment so that an earlier failure can't abort the prepare out from under later users
+			data->sync();
+			if (PQsendPrepare(pc, stmt.name.c_str(), stmt.sql.c_str(), params.n, params.types)) {
+				data->entries.push_back({private_data::entry_type::prepare, 0, stmt.name});
+				data->dirty = true;
+				data->sync();
+			}
+		}
+	}
+	if (!PQsendQueryPrepared(pc, stmt.name.c_str(), params.n, params.values, params.lengths, params.formats, static_cast<int>(stmt.format))) return idx;
+	data->entries.push_back({private_data::entry_type::query, idx, {}});
+	data->dirty = true;
+	if (stmt.mode == access::read_write) data->wrote = true;
+	return idx;
+}
+
+void postgres::pipeline::sync_point() {
+	if (data->active) data->sync();
+}
+
+bool postgres::pipeline::collect() {
+	if (!data->active) return true;
+	rainboa::metrics::timer t {pipeline_metric};
+	PGconn * pc = data->pgcon();
+	data->sync();
+	bool ok = true;
+	for (auto const & e : data->entries) {
+		PGresult * res = data->con.data->await() ? PQgetResult(pc) : nullptr;
+		if (!res) { ok = false; break; }
+		switch (e.type) {
+			case private_data::entry_type::sync:
+				PQclear(res);
+				continue; // no terminating null after a sync result
+			case private_data::entry_type::prepare:
+				if (PQresultStatus(res) == PGRES_COMMAND_OK) data->con.data->prepared.insert(e.name);
+				PQclear(res);
+				break;
+			case private_data::entry_type::query:
+				data->results[e.idx] = res;
+				break;
+		}
+		while (data->con.data->await() && (res = PQgetResult(pc))) PQclear(res);
+	}
+	data->entries.clear();
+	data->active = false;
+	data->dirty = false;
+	if (!ok || !PQexitPipelineMode(pc)) {
+		scilogve << "pipeline desynchronized, resetting connection: " << std::string {PQerrorMessage(pc)};
+		data->con.reset();
+		return false;
+	}
+	return true;
+}
+
+postgres::result & postgres::pipeline::get(size_t idx) { return data->results[idx]; }
+bool postgres::pipeline::wrote() const { return data->wrote; }
+
+bool postgres::connection::check() {
+	if (PQstatus(data->con) == CONNECTION_OK) PQconsumeInput(data->con);
+	data->ok = PQstatus(data->con) == CONNECTION_OK;
+	return data->ok;
+}
+
+bool postgres::connection::reset() {
+	data->prepared.clear();
+	PQreset(data->con);
+	data->ok = PQstatus(data->con) == CONNECTION_OK;
+	if (!data->ok) scilogve << asterid::strf("failed to reconnect to database (status %i)", PQstatus(data->con));
+	return data->ok;
+}
+
+std::string postgres::with_connect_timeout(std::string const & conninfo, std::chrono::seconds timeout) {
+	std::string ret = conninfo.find('=') == std::string::npos ? "user=postgres dbname=" + conninfo : conninfo;
+	if (ret.find("connect_timeout") == std::string::npos) ret += asterid::strf(" connect_timeout=%lld", static_cast<long long>(timeout.count()));
+	return ret;
+}
+
+postgres::pool::pool(std::string const & conninfo, config const & cfg) : conninfo(with_connect_timeout(conninfo, cfg.connect_timeout)), cfg(cfg) {
+	for (unsigned int i = 0; i < cfg.min_cons; i++) {
+		cons.emplace_back(new pool_con {this->conninfo});
 		if (!cons.back()->con.ok()) return;
+		idle.push_back(cons.back().get());
 	}
+	st.size = cons.size();
 	ok_ = true;
+	maint_thread = std::thread {[this](){ maintain(); }};
 }
 
-postgres::pool::conview postgres::pool::try_acquire() {
-	for (auto & pq : cons) {
-		if (pq->in_use.test_and_set()) continue;
-		return pq;
+postgres::pool::~pool() {
+	{
+		std::lock_guard<std::mutex> lk {m};
+		run = false;
+	}
+	maint_cv.notify_all();
+	if (maint_thread.joinable()) maint_thread.join();
+}
+
+void postgres::pool::conview::release() {
+	if (!ptr) return;
+	ptr->con.set_deadline(std::chrono::steady_clock::time_point::max());
+	if (in_transaction_block) cmd("ROLLBACK");
+	parent->release(ptr);
+	ptr = nullptr;
+}
+
+void postgres::pool::hand_off(pool_con * pc, std::unique_lock<std::mutex> &) {
+	if (!waiters.empty()) {
+		waiter * w = waiters.front();
+		waiters.pop_front();
+		w->con = pc;
+		w->cv.notify_one();
+		return;
+	}
+	pc->last_use = std::chrono::steady_clock::now();
+	idle.push_back(pc);
+}
+
+void postgres::pool::release(pool_con * pc) {
+	std::unique_lock<std::mutex> lk {m};
+	st.in_use--;
+	if (!pc->con.check()) {
+		pc->broken = true;
+		pc->backoff = std::chrono::milliseconds {0};
+		pc->retry_at = std::chrono::steady_clock::now();
+		st.broken++;
+		maint_wake = true;
+		maint_cv.notify_one();
+		return;
 	}
-	return {nullptr};
+	hand_off(pc, lk);
+}
+
+postgres::pool::conview postgres::pool::try_acquire() {
+	std::lock_guard<std::mutex> lk {m};
+	if (idle.empty() || !waiters.empty()) return {};
+	pool_con * pc = idle.back();
+	idle.pop_back();
+	st.acquisitions++;
+	st.in_use++;
+	return {this, pc};
 }
 
 postgres::pool::conview postgres::pool::acquire() {
-	while (true) {
-		for (auto & pq : cons) {
-			if (pq->in_use.test_and_set()) continue;
-			return pq;
+	return acquire(std::chrono::steady_clock::now() + cfg.acquire_timeout);
+}
+
+postgres::pool::conview postgres::pool::acquire(std::chrono::steady_clock::time_point deadline) {
+	rainboa::metrics::timer t {pool_wait_metric};
+	auto start = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lk {m};
+	
+	if (waiters.empty() && !idle.empty()) {
+		pool_con * pc = idle.back();
+		idle.pop_back();
+		st.acquisitions++;
+		st.in_use++;
+		return {this, pc};
+	}
+	
+	// growing takes a connect, which can take much longer than the deadline allows, so it happens on the maintenance thread
+	// the new connection goes to the front waiter like any released one, if it fails we keep waiting on the ones we have
+	if (cons.size() + connecting < cfg.max_cons) {
+		connecting++;
+		maint_cv.notify_one();
+	}
+	
+	waiter w;
+	waiters.push_back(&w);
+	st.waits++;
+	w.cv.wait_until(lk, deadline, [&](){ return w.con != nullptr; });
+	uint64_t waited = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	st.wait_ns_total += waited;
+	if (waited > st.wait_ns_max) st.wait_ns_max = waited;
+	if (!w.con) {
+		waiters.erase(std::find(waiters.begin(), waiters.end(), &w));
+		st.timeouts++;
+		return {};
+	}
+	st.acquisitions++;
+	st.in_use++;
+	return {this, w.con};
+}
+
+postgres::pool::stats postgres::pool::get_stats() {
+	std::lock_guard<std::mutex> lk {m};
+	stats ret = st;
+	ret.waiters = waiters.size();
+	return ret;
+}
+
+void postgres::pool::maintain() {
+	std::unique_lock<std::mutex> lk {m};
+	auto next_check = std::chrono::steady_clock::now() + cfg.health_interval;
+	while (run) {
+		maint_cv.wait_until(lk, next_check, [this](){ return !run || connecting || maint_wake; });
+		if (!run) break;
+		
+		while (connecting && run) {
+			lk.unlock();
+			std::unique_ptr<pool_con> pc {new pool_con {conninfo}};
+			lk.lock();
+			if (!pc->con.ok()) {
+				connecting = 0; // the database is unreachable, the waiters make do with what's open until they time out
+				break;
+			}
+			connecting--;
+			cons.emplace_back(std::move(pc));
+			st.size = cons.size();
+			hand_off(cons.back().get(), lk);
+		}
+		
+		auto now = std::chrono::steady_clock::now();
+		if (now < next_check && !maint_wake) continue;
+		next_check = now + cfg.health_interval;
+		maint_wake = false;
+		
+		// health check idle connections, closing the ones we've grown past min_cons and no longer need
+		for (auto i = idle.begin(); i != idle.end();) {
+			pool_con * pc = *i;
+			if (!pc->con.check()) {
+				pc->broken = true;
+				pc->backoff = std::chrono::milliseconds {0};
+				pc->retry_at = now;
+				st.broken++;
+				i = idle.erase(i);
+				continue;
+			}
+			if (cons.size() > cfg.min_cons && now - pc->last_use > cfg.idle_timeout) {
+				i = idle.erase(i);
+				cons.erase(std::find_if(cons.begin(), cons.end(), [pc](auto const & c){ return c.get() == pc; }));
+				st.size = cons.size();
+				continue;
+			}
+			i++;
+		}
+		
+		// reconnect broken connections, backing off exponentially while the database stays unreachable
+		for (size_t i = 0; i < cons.size(); i++) { // cons can grow while unlocked below
+			pool_con * pc = cons[i].get();
+			if (!pc->broken || now < pc->retry_at) continue;
+			lk.unlock();
+			bool ok = pc->con.reset();
+			lk.lock();
+			if (!ok) {
+				st.reconnect_failures++;
+				pc->backoff = std::min(std::max(pc->backoff * 2, cfg.reconnect_backoff_min), cfg.reconnect_backoff_max);
+				pc->retry_at = now + pc->backoff;
+				continue;
+			}
+			st.reconnects++;
+			st.broken--;
+			pc->broken = false;
+			hand_off(pc, lk);
 		}
-		std::unique_lock<std::mutex> lk(cvm);
-		cv.wait_for(lk, std::chrono::milliseconds(5));
 	}
 }
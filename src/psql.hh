@@ -1,5 +1,11 @@
 #pragma once
 #include "util.hh"
+#include "metrics.hh"
+
+#include <charconv>
+#include <deque>
+#include <thread>
+#include <tuple>
 
 inline std::string & sql_sanitize(std::string & str) {
 	std::string::iterator i = str.begin();
@@ -19,6 +25,147 @@ namespace postgres {
 	
 	typedef int64_t bigint_t;
 	typedef int32_t int_t;
+	typedef std::chrono::system_clock::time_point timestamp_t;
+	
+	enum struct result_format {
+		text,
+		binary, // integers and timestamps arrive in network byte order and decode without parsing
+	};
+	
+	// turns a raw cell into a C++ value, for either result format
+	namespace decode_internal {
+		
+		inline uint64_t read_be(std::string_view raw) {
+			uint64_t v = 0;
+			for (unsigned char c : raw) v = (v << 8) | c;
+			return v;
+		}
+		
+		template <typename T> inline T decode_int(std::string_view raw, bool binary) {
+			if (binary) {
+				switch (raw.size()) { // sign extend whatever width the column is
+					case 2: return static_cast<int16_t>(read_be(raw));
+					case 4: return static_cast<int32_t>(read_be(raw));
+					case 8: return static_cast<int64_t>(read_be(raw));
+					default: return 0;
+				}
+			}
+			T v = 0;
+			std::from_chars(raw.data(), raw.data() + raw.size(), v);
+			return v;
+		}
+		
+		timestamp_t decode_timestamp(std::string_view raw, bool binary);
+		
+		template <typename T> struct decoder;
+		template <> struct decoder<bigint_t> { static bigint_t decode(std::string_view raw, bool binary) { return decode_int<bigint_t>(raw, binary); } };
+		template <> struct decoder<int_t> { static int_t decode(std::string_view raw, bool binary) { return decode_int<int_t>(raw, binary); } };
+		template <> struct decoder<bool> { static bool decode(std::string_view raw, bool binary) { return !raw.empty() && (binary ? raw[0] != 0 : raw[0] == 't'); } };
+		template <> struct decoder<std::string_view> { static std::string_view decode(std::string_view raw, bool) { return raw; } };
+		template <> struct decoder<std::string> { static std::string decode(std::string_view raw, bool) { return std::string {raw}; } };
+		template <> struct decoder<timestamp_t> { static timestamp_t decode(std::string_view raw, bool binary) { return decode_timestamp(raw, binary); } };
+	}
+	
+	// statement parameters, each C++ argument picks its type OID and wire encoding at compile time
+	// everything but the array types lives on the stack, and nothing relies on NUL termination
+	namespace bind_internal {
+		
+		typedef unsigned int oid_t;
+		
+		struct param_view {
+			int n;
+			oid_t const * types;
+			char const * const * values;
+			int const * lengths;
+			int const * formats;
+		};
+		
+		inline void write_be(char * out, uint64_t v, size_t len) {
+			for (size_t i = 0; i < len; i++) out[i] = static_cast<char>(v >> ((len - 1 - i) * 8));
+		}
+		
+		struct no_storage {};
+		
+		template <typename T, oid_t OID> struct int_binder {
+			static constexpr oid_t oid = OID;
+			typedef std::array<char, sizeof(T)> storage;
+			static std::string_view bind(T v, storage & s) { write_be(s.data(), static_cast<uint64_t>(v), sizeof(T)); return {s.data(), sizeof(T)}; }
+		};
+		
+		struct text_binder {
+			static constexpr oid_t oid = 25; // TEXT, binary TEXT is just the bytes so the length is authoritative
+			typedef no_storage storage;
+			static std::string_view bind(std::string_view v, storage &) { return v; }
+		};
+		
+		struct bytea_binder {
+			static constexpr oid_t oid = 17; // BYTEA
+			typedef no_storage storage;
+			template <typename B> static std::string_view bind(B const & v, storage &) { return {reinterpret_cast<char const *>(v.data()), v.size()}; }
+		};
+		
+		// one dimensional arrays in the binary array wire format
+		template <typename E, typename EB, oid_t OID> struct array_binder {
+			static constexpr oid_t oid = OID;
+			typedef std::string storage;
+			static std::string_view bind(std::vector<E> const & v, storage & s) {
+				char hdr[20];
+				write_be(hdr, v.empty() ? 0 : 1, 4); // ndim
+				write_be(hdr + 4, 0, 4); // no nulls
+				write_be(hdr + 8, EB::oid, 4);
+				write_be(hdr + 12, v.size(), 4);
+				write_be(hdr + 16, 1, 4); // lower bound
+				s.append(hdr, v.empty() ? 12 : 20);
+				for (E const & e : v) {
+					typename EB::storage es;
+					std::string_view ev = EB::bind(e, es);
+					char len[4];
+					write_be(len, ev.size(), 4);
+					s.append(len, 4).append(ev);
+				}
+				return s;
+			}
+		};
+		
+		template <typename T> struct binder;
+		template <> struct binder<int64_t> : int_binder<int64_t, 20> {}; // INT8
+		template <> struct binder<int32_t> : int_binder<int32_t, 23> {}; // INT4
+		template <> struct binder<int16_t> : int_binder<int16_t, 21> {}; // INT2
+		template <> struct binder<bool> : int_binder<bool, 16> {}; // BOOL
+		template <> struct binder<std::string> : text_binder {};
+		template <> struct binder<std::string_view> : text_binder {};
+		template <> struct binder<char const *> : text_binder {};
+		template <size_t N> struct binder<char [N]> : text_binder {};
+		template <> struct binder<std::vector<uint8_t>> : bytea_binder {};
+		template <> struct binder<std::basic_string_view<uint8_t>> : bytea_binder {};
+		template <size_t N> struct binder<std::array<uint8_t, N>> : bytea_binder {};
+		template <> struct binder<std::vector<int64_t>> : array_binder<int64_t, binder<int64_t>, 1016> {}; // INT8[]
+		template <> struct binder<std::vector<std::string>> : array_binder<std::string, binder<std::string>, 1009> {}; // TEXT[]
+		
+		template <typename ... Ts> struct params {
+			static constexpr size_t n = sizeof ... (Ts);
+			std::tuple<typename binder<Ts>::storage ...> storage;
+			std::array<oid_t, n> types {binder<Ts>::oid ...};
+			std::array<char const *, n> values;
+			std::array<int, n> lengths;
+			std::array<int, n> formats;
+			
+			params(Ts const & ... args) { bind_all(std::index_sequence_for<Ts ...> {}, args ...); }
+			params(params const &) = delete; // values point into storage
+			inline param_view view() const { return {static_cast<int>(n), types.data(), values.data(), lengths.data(), formats.data()}; }
+			
+		private:
+			template <size_t ... I> void bind_all(std::index_sequence<I ...>, Ts const & ... args) {
+				(bind_one<I>(args), ...);
+			}
+			template <size_t I, typename T> void bind_one(T const & arg) {
+				std::string_view v = binder<T>::bind(arg, std::get<I>(storage));
+				values[I] = v.data();
+				lengths[I] = v.size();
+				formats[I] = 1;
+			}
+		};
+	}
 	
 	struct value {
 		inline value(char const * str) : str(str) {}
@@ -41,86 +188,209 @@ namespace postgres {
 		
 		int num_fields() const;
 		int num_rows() const;
-		value get_value(int row, int field) const;
+		value get_value(int row, int field) const; // copies, text format only, prefer get<T>
+		std::string_view get_view(int row, int field) const; // points into the result, valid until it's destroyed
+		bool is_null(int row, int field) const;
+		bool is_binary(int field) const;
+		template <typename T> T get(int row, int field) const { return decode_internal::decoder<T>::decode(get_view(row, field), is_binary(field)); }
 		std::string get_error() const;
+		std::string get_sqlstate() const;
+		std::string get_constraint() const; // the violated constraint's name, for integrity errors
 		bool cmd_ok() const;
 		bool tuples_ok() const;
 		
 		result & operator = (result const & other) = delete;
 		result & operator = (result && other);
 		inline value operator () (int row, int field) const { return get_value(row, field); }
+		
+		// typed row iteration without copies: for (auto [id, hash] : res.rows<bigint_t, std::string_view>())
+		template <typename ... Ts> struct row_range {
+			struct iterator {
+				result const * res;
+				int row;
+				inline std::tuple<Ts ...> operator * () const { return res->get_row<Ts ...>(row, std::index_sequence_for<Ts ...> {}); }
+				inline iterator & operator ++ () { row++; return *this; }
+				inline bool operator != (iterator const & other) const { return row != other.row; }
+			};
+			result const & res;
+			inline iterator begin() const { return {&res, 0}; }
+			inline iterator end() const { return {&res, res.num_rows()}; }
+		};
+		template <typename ... Ts> row_range<Ts ...> rows() const { return {*this}; }
+		template <typename ... Ts, size_t ... I> std::tuple<Ts ...> get_row(int row, std::index_sequence<I ...>) const { return {get<Ts>(row, I) ...}; }
 	private:
 		struct private_data;
 		std::unique_ptr<private_data> data;
 	};
 
+	// read_only statements may be routed to a replica, which can lag behind the primary
+	enum struct access {
+		read_write,
+		read_only,
+	};
+	
+	// named statement, prepared lazily on each connection the first time it is executed there
+	struct statement {
+		statement() = delete;
+		statement(std::string const & name, std::string const & sql, result_format format = result_format::text, access mode = access::read_write);
+		std::string const name;
+		std::string const sql;
+		result_format const format;
+		access const mode;
+		rainboa::metrics::metric_id const metric; // execution time histogram
+	};
+
 	struct connection {
 		connection() = delete;
-		connection(std::string const & dbname);
+		connection(std::string const & conninfo); // a libpq connection string, or just a database name to connect as postgres
 		connection(connection const &) = delete;
 		connection(connection &&) = delete;
 		~connection();
 		
 		result exec(std::string const & cmd);
-		result exec_params(std::string const & cmd, std::initializer_list<std::string_view>);
+		result exec_params(std::string const & cmd, bind_internal::param_view);
+		result exec_prepared(statement const & stmt, bind_internal::param_view);
+		template <typename ... Ts> inline result exec_params(std::string const & cmd, Ts const & ... args) { return exec_params(cmd, bind_internal::params<Ts ...> {args ...}.view()); }
+		template <typename ... Ts> inline result exec_prepared(statement const & stmt, Ts const & ... args) { return exec_prepared(stmt, bind_internal::params<Ts ...> {args ...}.view()); }
 		inline bool cmd(std::string const & cmd) { result res = exec(cmd); if (res.cmd_ok()) return true; else { scilogs << res.get_error(); return false; } }
-		inline bool cmd_params(std::string const & cmd, std::initializer_list<std::string_view> params) { result res = exec_params(cmd, std::move(params)); if (res.cmd_ok()) return true; else { scilogs << res.get_error(); return false; } }
+		template <typename ... Ts> inline bool cmd_params(std::string const & cmd, Ts const & ... args) { result res = exec_params(cmd, args ...); if (res.cmd_ok()) return true; else { scilogs << res.get_error(); return false; } }
+		template <typename ... Ts> inline bool cmd_prepared(statement const & stmt, Ts const & ... args) { result res = exec_prepared(stmt, args ...); if (res.cmd_ok()) return true; else { scilogs << res.get_error(); return false; } }
 		bool ok();
+		bool check(); // non-blocking liveness check, picks up connections the server has closed
+		bool reset(); // reconnect, forgets all prepared statements
+		
+		// waits up to timeout for NOTIFYs on channels this connection LISTENs to, false if the connection is lost
+		bool wait_notifications(std::chrono::milliseconds timeout, std::function<void(std::string_view channel, std::string_view payload)> const & on_notify);
+		
+		// statements still running at the deadline are cancelled server side and fail with SQLSTATE 57014, applies to pipelines too
+		void set_deadline(std::chrono::steady_clock::time_point);
+		
+	private:
+		friend struct pipeline;
+		struct private_data;
+		std::unique_ptr<private_data> data;
+	};
+	
+	// queues statements on a connection in libpq pipeline mode, everything queued is sent and collected in a single round trip
+	// results are only valid after collect(), indices returned by queue() stay valid for the lifetime of the pipeline
+	struct pipeline {
+		pipeline() = delete;
+		pipeline(connection &);
+		pipeline(pipeline const &) = delete;
+		pipeline(pipeline &&) = delete;
+		~pipeline();
+		
+		size_t queue(statement const & stmt, bind_internal::param_view);
+		template <typename ... Ts> inline size_t queue(statement const & stmt, Ts const & ... args) { return queue(stmt, bind_internal::params<Ts ...> {args ...}.view()); }
+		void sync_point(); // an error in a statement aborts the rest of the pipeline up to the next sync point
+		bool collect(); // false if the connection failed, any uncollected results are left as errors
+		result & get(size_t idx);
+		bool wrote() const; // a read_write statement has been queued at some point
 		
 	private:
 		struct private_data;
 		std::unique_ptr<private_data> data;
 	};
 
+	// adds libpq's connect_timeout unless the connection string already has one, a blackholed server otherwise blocks for the OS TCP timeout
+	std::string with_connect_timeout(std::string const & conninfo, std::chrono::seconds timeout);
+
 	struct pool {
 		
+		struct config {
+			unsigned int min_cons = 1; // opened up front and kept open
+			unsigned int max_cons = std::thread::hardware_concurrency(); // grown into on demand
+			std::chrono::milliseconds acquire_timeout {5000};
+			std::chrono::milliseconds idle_timeout {60000}; // connections above min_cons idle for this long are closed
+			std::chrono::milliseconds health_interval {1000};
+			std::chrono::milliseconds reconnect_backoff_min {100};
+			std::chrono::milliseconds reconnect_backoff_max {10000};
+			std::chrono::seconds connect_timeout {5}; // handed to libpq, the most opening or resetting a connection can block
+		};
+		
+		struct stats {
+			uint64_t acquisitions = 0;
+			uint64_t waits = 0; // acquisitions that had to queue
+			uint64_t timeouts = 0;
+			uint64_t wait_ns_total = 0;
+			uint64_t wait_ns_max = 0;
+			uint64_t reconnects = 0;
+			uint64_t reconnect_failures = 0;
+			unsigned int size = 0;
+			unsigned int in_use = 0;
+			unsigned int broken = 0;
+			unsigned int waiters = 0;
+		};
+		
 		struct pool_con {
 			pool_con() = delete;
-			pool_con(std::string dbname, std::mutex & cvm, std::condition_variable & cv) : con(dbname), in_use(false), cvm(cvm), cv(cv) {}
-			~pool_con() = default;
-			void reset() {
-				in_use.clear();
-				cv.notify_one();
-			}
+			pool_con(std::string const & conninfo) : con(conninfo) {}
 			connection con;
-			std::atomic_flag in_use;
-		private:
-			std::mutex & cvm;
-			std::condition_variable & cv;
+			std::chrono::steady_clock::time_point last_use;
+			std::chrono::steady_clock::time_point retry_at;
+			std::chrono::milliseconds backoff {0};
+			bool broken = false;
 		};
 		
 		struct conview {
-			conview() = delete;
-			conview(std::shared_ptr<pool_con> ptr) : ptr(ptr) {}
-			~conview() {
-				if (in_transaction_block) cmd("ROLLBACK");
-				ptr->reset();
-			}
+			conview() = default;
+			conview(pool * parent, pool_con * ptr) : parent(parent), ptr(ptr) {}
+			conview(conview const &) = delete;
+			conview(conview && other) : parent(other.parent), ptr(other.ptr), in_transaction_block(other.in_transaction_block) { other.ptr = nullptr; }
+			~conview() { release(); }
+			conview & operator = (conview const &) = delete;
+			conview & operator = (conview && other) { release(); parent = other.parent; ptr = other.ptr; in_transaction_block = other.in_transaction_block; other.ptr = nullptr; return *this; }
 			
 			inline bool ok() { return ptr && ptr->con.ok(); }
+			inline connection & con() { return ptr->con; }
 			inline result exec(std::string const & cmd) { return ptr->con.exec(cmd); }
-			inline result exec_params(std::string const & cmd, std::initializer_list<std::string_view> params) { return ptr->con.exec_params(cmd, std::move(params)); }
+			template <typename ... Ts> inline result exec_params(std::string const & cmd, Ts const & ... args) { return ptr->con.exec_params(cmd, args ...); }
+			template <typename ... Ts> inline result exec_prepared(statement const & stmt, Ts const & ... args) { return ptr->con.exec_prepared(stmt, args ...); }
 			inline bool cmd(std::string const & cmd) { return ptr->con.cmd(cmd); }
-			inline bool cmd_params(std::string const & cmd, std::initializer_list<std::string_view> params) { return ptr->con.cmd_params(cmd, std::move(params)); }
+			template <typename ... Ts> inline bool cmd_params(std::string const & cmd, Ts const & ... args) { return ptr->con.cmd_params(cmd, args ...); }
+			template <typename ... Ts> inline bool cmd_prepared(statement const & stmt, Ts const & ... args) { return ptr->con.cmd_prepared(stmt, args ...); }
+			inline void set_deadline(std::chrono::steady_clock::time_point tp) { ptr->con.set_deadline(tp); }
 			inline void begin() { cmd("BEGIN"); in_transaction_block = true; }
-			inline void commit() { cmd("COMMIT"); in_transaction_block = false; }
+			inline bool commit() { in_transaction_block = false; return cmd("COMMIT"); } // a failed COMMIT has rolled the transaction back
 			inline void rollback() { cmd("ROLLBACK"); in_transaction_block = false; }
 		private:
-			std::shared_ptr<pool_con> ptr;
+			void release();
+			pool * parent = nullptr;
+			pool_con * ptr = nullptr;
 			bool in_transaction_block = false;
 		};
 		
-		pool(std::string const & dbname, unsigned int num_cons = std::thread::hardware_concurrency());
-		~pool() = default;
+		pool(std::string const & conninfo, config const & cfg);
+		~pool();
 		
 		inline bool ok() { return ok_; }
-		conview try_acquire(); // check ok() before using conview, ALWAYS
-		conview acquire(); // blocks until available, no need to check ok()
+		conview try_acquire(); // never blocks, check ok() before using conview, ALWAYS
+		conview acquire(); // waits up to config::acquire_timeout, check ok()
+		conview acquire(std::chrono::steady_clock::time_point deadline);
+		stats get_stats();
 	private:
+		struct waiter {
+			std::condition_variable cv;
+			pool_con * con = nullptr;
+		};
+		
+		void release(pool_con *);
+		void hand_off(pool_con *, std::unique_lock<std::mutex> &);
+		void maintain();
+		
+		std::string const conninfo;
+		config const cfg;
 		bool ok_ = false;
-		std::mutex cvm;
-		std::condition_variable cv;
-		std::vector<std::shared_ptr<pool_con>> cons;
+		bool run = true;
+		bool maint_wake = false; // a connection broke, reconnect without waiting for the next health check
+		unsigned int connecting = 0; // asked for by acquire(), opened by the maintenance thread so no caller ever blocks on a connect
+		std::mutex m;
+		std::condition_variable maint_cv;
+		std::vector<std::unique_ptr<pool_con>> cons;
+		std::vector<pool_con *> idle; // most recently used at the back
+		std::deque<waiter *> waiters; // served strictly in arrival order
+		stats st;
+		std::thread maint_thread;
 	};
 
 }
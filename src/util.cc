@@ -4,60 +4,119 @@
 #include <botan/lookup.h>
 #include <botan/cipher_mode.h>
 
-#include <mutex>
-#include <iostream>
 
-static Botan::AutoSeeded_RNG rng {};
-static std::unique_ptr<Botan::HashFunction> blake2b = nullptr;
+// Botan RNGs and hash functions are stateful and not safe to share, so every thread gets its own
+struct crypto_context {
+	Botan::AutoSeeded_RNG rng {};
+	std::unique_ptr<Botan::HashFunction> blake2b = Botan::HashFunction::create("Blake2b");
+};
 
-static size_t randrange(size_t min, size_t max) { // [min,max)
-	size_t i, r = max - min;
-	rng.randomize(reinterpret_cast<uint8_t *>(&i), sizeof(i));
-	return min + (i % r);
+static crypto_context & crypto() {
+	static thread_local crypto_context ctx {};
+	return ctx;
+}
+
+// fills out with characters drawn uniformly from chars, rejecting the bytes that would bias a plain modulo
+static void fill_random_chars(char * out, size_t len, std::string_view chars) {
+	Botan::AutoSeeded_RNG & rng = crypto().rng;
+	size_t const n = chars.size();
+	if (n > 256) {
+		uint32_t const limit = UINT32_MAX - UINT32_MAX % n;
+		for (size_t i = 0; i < len;) {
+			uint32_t r;
+			rng.randomize(reinterpret_cast<uint8_t *>(&r), sizeof(r));
+			if (r < limit) out[i++] = chars[r % n];
+		}
+		return;
+	}
+	unsigned const limit = 256 - 256 % n;
+	uint8_t buf[1024];
+	for (size_t i = 0; i < len;) {
+		size_t want = len - i;
+		size_t draw = std::min(want + want / 2 + 16, sizeof(buf)); // enough extra that a refill is rare
+		rng.randomize(buf, draw);
+		for (size_t j = 0; j < draw && i < len; j++) {
+			if (buf[j] < limit) out[i++] = chars[buf[j] % n];
+		}
+	}
 }
 
 void rainboa::util::init() {
-	blake2b = Botan::HashFunction::create("Blake2b");
-	if (!blake2b) {
+	logging_internal::init();
+	if (!crypto().blake2b) {
 		throwe(startup);
 	}
 }
 
 void rainboa::util::term() noexcept {
-	blake2b.reset();
+	logging_internal::term();
+}
+
+std::string rainboa::util::setting(char const * name, std::string const & def) {
+	char const * v = getenv((std::string {"RAINBOA_"} + name).c_str());
+	return v && *v ? v : def;
 }
 
-static std::mutex log_mut {};
-void rainboa::util::log(log_level, std::string const & str) {
-	log_mut.lock();
-	std::cout << str << std::endl;
-	log_mut.unlock();
+long long rainboa::util::setting_int(char const * name, long long def) {
+	std::string v = setting(name);
+	if (v.empty()) return def;
+	char * end;
+	long long i = strtoll(v.c_str(), &end, 10);
+	if (*end) {
+		scilogw << asterid::strf("ignoring malformed setting RAINBOA_%s=\"%s\"", name, v.c_str());
+		return def;
+	}
+	return i;
+}
+
+unsigned rainboa::util::worker_threads() {
+	return std::max<long long>(setting_int("WORKERS", 4), 1);
+}
+
+unsigned rainboa::util::server_threads() {
+	return std::max<long long>(setting_int("SERVER_THREADS", worker_threads() * 4), 1);
 }
 
 asterid::buffer_assembly rainboa::util::random(size_t len) {
-	auto vec = rng.random_vec(len);
 	asterid::buffer_assembly bb {};
 	bb.resize(len);
-	memcpy(bb.data(), vec.data(), len);
+	crypto().rng.randomize(bb.data(), len);
 	return bb;
 }
 
-std::string rainboa::util::random_str(size_t len, std::string const & chars) {
-	std::string ret;
-	for (size_t i = 0; i < len; i++) {
-		ret += chars[randrange(0, chars.size())];
-	}
+std::string rainboa::util::random_str(size_t len, std::string_view chars) {
+	std::string ret (len, '\0');
+	fill_random_chars(ret.data(), len, chars);
 	return ret;
 }
 
-asterid::buffer_assembly rainboa::util::hash_blake2b(std::string str) {
-	auto buf = blake2b->process(str);
-	asterid::buffer_assembly bb {};
-	bb.resize(buf.size());
-	memcpy(bb.data(), buf.data(), bb.size());
-	return bb;
+std::vector<std::string> rainboa::util::random_strs(size_t count, size_t len, std::string_view chars) {
+	std::string all (count * len, '\0');
+	fill_random_chars(all.data(), all.size(), chars);
+	std::vector<std::string> ret;
+	ret.reserve(count);
+	for (size_t i = 0; i < count; i++) ret.emplace_back(all, i * len, len);
+	return ret;
+}
+
+rainboa::util::blake2b_digest rainboa::util::hash_blake2b(std::string_view str) {
+	Botan::HashFunction & h = *crypto().blake2b;
+	h.update(reinterpret_cast<uint8_t const *>(str.data()), str.size());
+	blake2b_digest ret;
+	h.final(ret.data());
+	return ret;
+}
+
+std::string rainboa::util::hex(uint8_t const * data, size_t len) {
+	static constexpr char digits[] = "0123456789abcdef";
+	std::string ret (len * 2, '\0');
+	for (size_t i = 0; i < len; i++) {
+		ret[i * 2] = digits[data[i] >> 4];
+		ret[i * 2 + 1] = digits[data[i] & 0xF];
+	}
+	return ret;
 }
 
 void rainboa::util::randomize_data(void * ptr, size_t len) {
-	rng.randomize(reinterpret_cast<uint8_t *>(ptr), sizeof(len));
+	crypto().rng.randomize(reinterpret_cast<uint8_t *>(ptr), len);
 }
@@ -5,15 +5,15 @@
 
 #include <locust/locust.hh>
 
+#include <array>
 #include <csignal>
 #include <sstream>
+#include <string_view>
 #include <functional>
 #include <unordered_map>
 
 
 
-#define NUM_CON 4
-
 namespace rainboa {
 	
 	namespace exception {
@@ -25,6 +25,15 @@ namespace rainboa {
 		void init();
 		void term() noexcept;
 		
+		// runtime settings, read from RAINBOA_<name> environment variables
+		std::string setting(char const * name, std::string const & def = "");
+		long long setting_int(char const * name, long long def);
+		
+		// batches worked on at once, RAINBOA_WORKERS, the default database pool size
+		unsigned worker_threads();
+		// threads accepting requests, RAINBOA_SERVER_THREADS, more than worker_threads() so that excess requests reach admission control and get shed
+		unsigned server_threads();
+		
 		enum struct log_level {
 			info,
 			warning,
@@ -33,29 +42,56 @@ namespace rainboa {
 			debug,
 			sql
 		};
-		void log(log_level, std::string const &);
+		
+		// lines are queued on a per-thread ring and written out by a background thread, see util_log.cc
+		// disabled levels are filtered by the scilog macros before anything is formatted
+		void log(log_level, std::string &&);
+		void set_log_enabled(log_level, bool);
 		
 		namespace logging_internal {
+			extern std::atomic<unsigned> log_mask;
+			void init();
+			void term() noexcept;
+			
 			struct cilogger {
 				util::log_level level;
 				std::string str;
-				inline cilogger(util::log_level lev, std::string const & init = "") : level(lev), str(init) {}
-				inline ~cilogger() { util::log(level, str); }
+				inline cilogger(util::log_level lev, std::string_view prefix) : level(lev), str(prefix) {}
+				inline cilogger(util::log_level lev, std::string_view prefix, std::string_view where) : level(lev) {
+					str.reserve(prefix.size() + where.size() + 64);
+					str.append(prefix).append(" (").append(where).append("): ");
+				}
+				inline ~cilogger() { util::log(level, std::move(str)); }
 				
 				inline cilogger & operator << ( std::string const & other ) { str += other; return *this; }
 				inline cilogger & operator << ( char const * other ) { str += other; return *this; }
 				template <typename T> inline cilogger & operator << ( T const & other ) { str += std::to_string(other); return *this; }
 			};
 			
+			// lets the scilog macros be a single expression: & binds looser than <<, so the whole chain is built before being discarded
+			struct voidify {
+				inline void operator & (cilogger const &) {}
+			};
+			
 			struct cilogger_dummy {
 				inline cilogger_dummy() {}
 				template <typename T> inline cilogger_dummy & operator << ( T const & ) {return *this; }
 			};
 		}
 		
+		inline bool log_enabled(log_level lev) { return logging_internal::log_mask.load(std::memory_order_relaxed) & (1u << static_cast<unsigned>(lev)); }
+		
+		// all of these use per-thread RNG and hash state, no locking involved
+		
+		typedef std::array<uint8_t, 64> blake2b_digest;
+		
 		asterid::buffer_assembly random(size_t len);
-		std::string random_str(size_t len, std::string const & chars);
-		asterid::buffer_assembly hash_blake2b(std::string str);
+		std::string random_str(size_t len, std::string_view chars);
+		std::vector<std::string> random_strs(size_t count, size_t len, std::string_view chars); // one RNG draw for the whole set
+		blake2b_digest hash_blake2b(std::string_view str);
+		
+		std::string hex(uint8_t const * data, size_t len); // lowercase
+		template <size_t N> std::string hex(std::array<uint8_t, N> const & v) { return hex(v.data(), N); }
 		
 		void randomize_data(void * ptr, size_t len);
 		template <typename T> void randomize(T & v) { randomize_data(reinterpret_cast<void *>(&v), sizeof(T)); }
@@ -63,8 +99,8 @@ namespace rainboa {
 	}
 }
 
-#define scilog(prefix, lev) rainboa::util::logging_internal::cilogger { lev, #prefix ": " }
-#define scilogv(prefix, lev) rainboa::util::logging_internal::cilogger { lev, asterid::strf("%s (%s): ", #prefix, _as_here) }
+#define scilog(prefix, lev) !rainboa::util::log_enabled(lev) ? (void)0 : rainboa::util::logging_internal::voidify {} & rainboa::util::logging_internal::cilogger { lev, #prefix ": " }
+#define scilogv(prefix, lev) !rainboa::util::log_enabled(lev) ? (void)0 : rainboa::util::logging_internal::voidify {} & rainboa::util::logging_internal::cilogger { lev, #prefix, _as_here }
 #define scilogi scilog(INFO, rainboa::util::log_level::info)
 #define scilogvi scilogv(INFO, rainboa::util::log_level::info)
 #define scilogw scilog(WARNING, rainboa::util::log_level::warning)
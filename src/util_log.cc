@@ -0,0 +1,209 @@
+#include "util.hh"
+
+#include <cstdio>
+
+using namespace rainboa::util;
+using namespace rainboa::util::logging_internal;
+
+static constexpr size_t ring_size = 1024; // per thread, lines past this are dropped rather than blocking the caller
+static constexpr size_t repeat_burst = 5; // identical lines let through per window before suppressing
+static constexpr std::chrono::seconds repeat_window {1};
+static constexpr std::chrono::milliseconds drain_interval {20};
+
+std::atomic<unsigned> rainboa::util::logging_internal::log_mask {~0u};
+
+namespace {
+	
+	// single producer (the owning thread), single consumer (the drain thread)
+	struct ring {
+		struct slot {
+			log_level level;
+			std::string str;
+		};
+		slot slots[ring_size];
+		std::atomic<size_t> head {0}; // next write, owned by the producer
+		std::atomic<size_t> tail {0}; // next read, owned by the consumer
+		std::atomic<size_t> dropped {0};
+		std::atomic_bool orphaned {false}; // owning thread has exited
+		
+		bool push(log_level lev, std::string && str) {
+			size_t h = head.load(std::memory_order_relaxed);
+			if (h - tail.load(std::memory_order_acquire) == ring_size) {
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			slot & s = slots[h % ring_size];
+			s.level = lev;
+			s.str = std::move(str);
+			head.store(h + 1, std::memory_order_release);
+			return true;
+		}
+		
+		template <typename F> void drain(F && func) {
+			size_t t = tail.load(std::memory_order_relaxed);
+			size_t h = head.load(std::memory_order_acquire);
+			for (; t != h; t++) {
+				slot & s = slots[t % ring_size];
+				func(s.level, s.str);
+				s.str.clear();
+			}
+			tail.store(t, std::memory_order_release);
+		}
+		
+		bool empty() { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_relaxed); }
+	};
+	
+	struct ring_handle {
+		std::shared_ptr<ring> r;
+		ring_handle();
+		~ring_handle() { r->orphaned.store(true); }
+	};
+	
+	struct repeat_state {
+		std::chrono::steady_clock::time_point window_start;
+		size_t count;
+	};
+}
+
+static std::mutex rings_m;
+static std::vector<std::shared_ptr<ring>> rings;
+
+static std::mutex drain_m;
+static std::condition_variable drain_cv;
+static std::thread drainer;
+static std::atomic_bool running {false};
+static FILE * out = stdout;
+
+ring_handle::ring_handle() : r {std::make_shared<ring>()} {
+	std::lock_guard<std::mutex> lk {rings_m};
+	rings.push_back(r);
+}
+
+// the drain thread alone touches these
+static std::unordered_map<std::string, repeat_state> repeats;
+static std::vector<std::string> suppressing; // lines whose current window went over the burst, their count is still owed
+static std::string batch;
+
+static void emit(log_level, std::string const & str, std::chrono::steady_clock::time_point now) {
+	auto i = repeats.find(str);
+	if (i == repeats.end()) {
+		repeats.emplace(str, repeat_state {now, 1});
+	} else if (now - i->second.window_start > repeat_window) {
+		if (i->second.count > repeat_burst) batch.append(asterid::strf("(previous message suppressed %zu times)\n", i->second.count - repeat_burst));
+		i->second = {now, 1};
+	} else if (++i->second.count > repeat_burst) {
+		if (i->second.count == repeat_burst + 1) suppressing.push_back(str);
+		return;
+	}
+	batch.append(str).push_back('\n');
+}
+
+static void drain_all(bool final = false) { // final: shutting down, settle every owed count now
+	auto now = std::chrono::steady_clock::now();
+	std::vector<std::shared_ptr<ring>> snapshot;
+	{
+		std::lock_guard<std::mutex> lk {rings_m};
+		snapshot = rings;
+		// rings of exited threads are dropped once they've been emptied
+		rings.erase(std::remove_if(rings.begin(), rings.end(), [](auto const & r){ return r->orphaned.load() && r->empty(); }), rings.end());
+	}
+	for (auto & r : snapshot) {
+		r->drain([now](log_level lev, std::string const & str){ emit(lev, str, now); });
+		size_t dropped = r->dropped.exchange(0, std::memory_order_relaxed);
+		if (dropped) batch.append(asterid::strf("(log ring full, %zu messages dropped)\n", dropped));
+	}
+	
+	// a burst that simply stops never sees its line again, so report what it suppressed once its window is over
+	for (auto s = suppressing.begin(); s != suppressing.end();) {
+		auto i = repeats.find(*s);
+		if (i != repeats.end() && i->second.count > repeat_burst) {
+			if (!final && now - i->second.window_start <= repeat_window) { s++; continue; }
+			batch.append(asterid::strf("(\"%s\" suppressed %zu times)\n", s->c_str(), i->second.count - repeat_burst));
+			repeats.erase(i);
+		}
+		s = suppressing.erase(s);
+	}
+	
+	// forget repeat windows that have long expired so the map doesn't grow without bound
+	if (repeats.size() > 4096) {
+		for (auto i = repeats.begin(); i != repeats.end();) {
+			if (now - i->second.window_start > repeat_window) i = repeats.erase(i);
+			else i++;
+		}
+	}
+	
+	if (batch.empty()) return;
+	fwrite(batch.data(), 1, batch.size(), out);
+	fflush(out);
+	batch.clear();
+}
+
+static void drain_loop() {
+	std::unique_lock<std::mutex> lk {drain_m};
+	while (running.load()) {
+		drain_cv.wait_for(lk, drain_interval);
+		lk.unlock();
+		drain_all();
+		lk.lock();
+	}
+}
+
+void rainboa::util::log(log_level lev, std::string && str) {
+	if (!running.load(std::memory_order_relaxed)) {
+		// before init or after term, nothing will drain a ring so write straight through
+		static std::mutex direct_m;
+		std::lock_guard<std::mutex> lk {direct_m};
+		fwrite(str.data(), 1, str.size(), stdout);
+		fputc('\n', stdout);
+		fflush(stdout);
+		return;
+	}
+	static thread_local ring_handle handle {};
+	handle.r->push(lev, std::move(str));
+	if (lev == log_level::fatal) drain_cv.notify_one();
+}
+
+void rainboa::util::set_log_enabled(log_level lev, bool enabled) {
+	unsigned bit = 1u << static_cast<unsigned>(lev);
+	if (enabled) log_mask.fetch_or(bit);
+	else log_mask.fetch_and(~bit);
+}
+
+void rainboa::util::logging_internal::init() {
+	static std::pair<char const *, log_level> const names[] = {
+		{"info", log_level::info},
+		{"warning", log_level::warning},
+		{"error", log_level::error},
+		{"fatal", log_level::fatal},
+		{"debug", log_level::debug},
+		{"sql", log_level::sql},
+	};
+	// comma separated list of levels to silence, e.g. RAINBOA_LOG_DISABLE=info,sql
+	std::string disable = setting("LOG_DISABLE");
+	for (auto const & [name, lev] : names) {
+		if (disable.find(name) != std::string::npos) set_log_enabled(lev, false);
+	}
+	
+	std::string path = setting("LOG_FILE");
+	if (!path.empty()) {
+		FILE * f = fopen(path.c_str(), "a");
+		if (f) out = f;
+		else scilogw << asterid::strf("could not open log file \"%s\", logging to stdout", path.c_str());
+	}
+	
+	running.store(true);
+	drainer = std::thread {drain_loop};
+}
+
+void rainboa::util::logging_internal::term() noexcept {
+	if (!drainer.joinable()) return;
+	{
+		std::lock_guard<std::mutex> lk {drain_m};
+		running.store(false);
+	}
+	drain_cv.notify_all();
+	drainer.join();
+	drain_all(true);
+	if (out != stdout) fclose(out);
+	out = stdout;
+}